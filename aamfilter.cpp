@@ -1,5 +1,6 @@
 #include "common.h"
 #include "ioutils.h"
+#include "datacache.h"
 #include "aammodel.h"
 #include "utils.h"
 
@@ -16,7 +17,21 @@ int main(int argc, char** argv) {
   desc.add_options()
     ("settings_file", po::value<string>()->required(), "Input settings file")
     ("output_path", po::value<string>()->default_value("."), "Output folder")
-    ("mode", po::value<string>()->default_value("filter"), "Mode to run");
+    ("model_out", po::value<string>()->default_value(""), "File to save the model to in build mode, not saved if empty")
+    ("mode", po::value<string>()->default_value("filter"), "Mode to run")
+    ("threads", po::value<int>()->default_value(0), "Number of threads for image loading and preprocessing, 0 uses all cores")
+    ("max_inflight_mb", po::value<int>()->default_value(1024), "Cap on decoded image data waiting to be consumed, in MB")
+    ("pack_cache", po::value<string>()->default_value(""), "Packed dataset file to load images from on demand, rebuilt when the dataset changes; implies --streaming")
+    ("streaming", po::bool_switch()->default_value(false), "Keep only texture rows resident, convert images on demand")
+    ("lazy_images", po::bool_switch()->default_value(false), "Decode images on demand instead of up front, implies --streaming")
+    ("uint8_images", po::bool_switch()->default_value(false), "Keep input images as 8-bit BGR and sample them in fixed point, saves memory")
+    ("pyramid_levels", po::value<int>()->default_value(0), "Run the outlier rounds on textures downsampled this many times, re-scoring only borderline samples at full resolution; 0 disables it")
+    ("borderline_band", po::value<double>()->default_value(0.5), "Distance to the outlier cut, in standard deviations, within which coarse scores are re-checked at full resolution")
+    ("pca_backend", po::value<string>()->default_value("exact"), "Decomposition for the PCA models: exact or randomized")
+    ("pca_seed", po::value<uint64_t>()->default_value(0), "Seed of the randomized PCA backend")
+    ("pca_tolerance", po::value<double>()->default_value(1e-4), "Randomized PCA stops growing the rank once a block adds less than this fraction of the variance")
+    ("image_budget_mb", po::value<int>()->default_value(1024), "Memory budget for images kept resident in streaming mode, in MB")
+    ("raster_cache", po::value<string>()->default_value(""), "Folder for the cached texture space raster, reused while the mean shape is unchanged");
 
   po::variables_map vm;
 
@@ -36,6 +51,12 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  const string pca_backend = vm["pca_backend"].as<string>();
+  if(pca_backend != "exact" && pca_backend != "randomized") {
+    cerr << "Error: unknown PCA backend " << pca_backend << ", expected exact or randomized" << endl;
+    return 1;
+  }
+
   const string settings_filename(vm["settings_file"].as<string>());
 
   // Parse the setting file and load image related resources
@@ -43,28 +64,74 @@ int main(int argc, char** argv) {
 
   vector<pair<string, string>> image_points_filenames = ParseSettingsFile(settings_filename);
 
-  int nentries = image_points_filenames.size();
-  vector<QImage> images(nentries);
-  vector<cv::Mat> points(nentries);
-
-  for(auto& p : enumerate(image_points_filenames)) {
-    fs::path image_filename = settings_filepath.parent_path() / fs::path(p.second.first);
-    fs::path pts_filename = settings_filepath.parent_path() / fs::path(p.second.second);
-    cout << "[" << image_filename << ", " << pts_filename << "]" << endl;
-
-    int i = p.first;
-    tie(images[i], points[i]) = LoadImagePointsPair(image_filename.string(), pts_filename.string());
+  for(auto& p : image_points_filenames) {
+    p.first = (settings_filepath.parent_path() / fs::path(p.first)).string();
+    p.second = (settings_filepath.parent_path() / fs::path(p.second)).string();
   }
 
-  AAMModel model(images, points);
+  LoaderOptions loader_options;
+  loader_options.nthreads = vm["threads"].as<int>();
+  loader_options.max_inflight_bytes = static_cast<size_t>(vm["max_inflight_mb"].as<int>()) << 20;
+
+  shared_ptr<ImageProvider> image_provider;
+  vector<cv::Mat> points;
+
+  // Images may share memory with the packed dataset, keep it mapped until exit
+  shared_ptr<PackedDataset> dataset;
+  const string pack_cache = vm["pack_cache"].as<string>();
+  const bool lazy_images = vm["lazy_images"].as<bool>();
+  if(!pack_cache.empty()) {
+    dataset = OpenPackedDataset(settings_filename, image_points_filenames, pack_cache, loader_options);
+    if(!dataset) return 1;
+    image_provider = make_shared<PackedImageProvider>(dataset);
+    points = dataset->Points();
+  } else if(lazy_images) {
+    // Only the points are loaded now, images are decoded when needed
+    boost::timer::auto_cpu_timer t("Loaded points in %w seconds.\n");
+    vector<string> image_filenames, points_filenames;
+    for(auto& p : image_points_filenames) {
+      image_filenames.push_back(p.first);
+      points_filenames.push_back(p.second);
+    }
+    points = LoadPointsFiles(points_filenames, loader_options.nthreads);
+    image_provider = make_shared<FileImageProvider>(image_filenames);
+  } else {
+    boost::timer::auto_cpu_timer t("Loaded images and points in %w seconds.\n");
+    vector<QImage> images;
+    tie(images, points) = LoadImagePointsPairs(image_points_filenames, loader_options);
+    image_provider = make_shared<InMemoryImageProvider>(images);
+  }
+  cout << points.size() << " entries loaded." << endl;
+
+  PCAOptions pca_options;
+  pca_options.backend = pca_backend == "randomized" ? PCAOptions::Randomized : PCAOptions::Exact;
+  pca_options.seed = vm["pca_seed"].as<uint64_t>();
+  pca_options.tolerance = vm["pca_tolerance"].as<double>();
+  pca_options.nthreads = vm["threads"].as<int>();
+
+  AAMModel model;
+  model.SetThreadCount(loader_options.nthreads);
+  model.SetImageProvider(image_provider);
+  model.SetPoints(points);
+  model.SetKeep8BitImages(vm["uint8_images"].as<bool>());
+  model.SetStreaming(vm["streaming"].as<bool>() || lazy_images || dataset);
+  model.SetImageBudget(static_cast<size_t>(vm["image_budget_mb"].as<int>()) << 20);
+  model.SetRasterCachePath(vm["raster_cache"].as<string>());
+  model.SetPCAOptions(pca_options);
+  model.SetPyramidLevels(vm["pyramid_levels"].as<int>(), vm["borderline_band"].as<double>());
+  model.Preprocess();
   model.SetOutputPath(vm["output_path"].as<string>());
   model.SetErrorMetric(AAMModel::FittingError);
 
   if(vm["mode"].as<string>() == "filter"){
     boost::timer::auto_cpu_timer t("Outlier detection finished in %w seconds.\n");
-    vector<int> indices = model.FindInliers_Iterative();
+    const bool coarse_to_fine = vm["pyramid_levels"].as<int>() > 0;
+    vector<int> indices = model.FindInliers_Iterative(vector<int>(), coarse_to_fine ? AAMModel::CoarseToFine
+                                                                                    : AAMModel::RobustPCA);
   } else if(vm["mode"].as<string>() == "build") {
     model.BuildModel();
+    const string model_out = vm["model_out"].as<string>();
+    if(!model_out.empty() && !model.SaveModel(model_out)) return 1;
   }
 
   return 0;
@@ -1,8 +1,13 @@
 #include "aammodel.h"
 #include "utils.h"
 #include "ioutils.h"
+#include "parallel.h"
+#include "procrustes.h"
+#include "warp.h"
 #include "robust_pca/robust_pca.h"
 
+#include <cstring>
+
 namespace aam {
   using namespace std;
 
@@ -17,7 +22,7 @@ namespace aam {
   }
 
   AAMModel::AAMModel(const std::vector<QImage>& images, const std::vector<Mat>& points)
-    : input_images(images), input_points(points) {
+    : image_provider(std::make_shared<InMemoryImageProvider>(images)), input_points(points) {
 
     Init();
     Preprocess();
@@ -33,10 +38,34 @@ namespace aam {
 
       fs::create_directory(p);
     }
+
+    // Low rank recovery of the rows of M, M is CV_32FC1 or CV_64FC1
+    template <typename T>
+    Mat rpca(const Mat& M) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> MatrixType;
+      MatrixType D, A, E;
+      D = CVMat2EigenMatrix<T>(M);
+      #if 1
+      MatrixType DT = D.transpose();
+      sp::ml::robust_pca(DT, A, E);
+      MatrixType AT = A.transpose();
+      return EigenMatrix2CVMat(AT);
+      #else
+      sp::ml::robust_pca(D, A, E);
+      return EigenMatrix2CVMat(A);
+      #endif
+    }
   }
 
   void AAMModel::Init() {
     metric = TextureError;
+    streaming = false;
+    keep_8bit_images = false;
+    image_budget = size_t(1) << 30;
+    nthreads = 0;
+    pyramid_levels = 0;
+    borderline_band = 0.5;
+    raster_cache_path = "";
 
     triangles = LoadTriangulation("/home/phg/Data/Multilinear/landmarks_triangulation.dat");
     // Convert to 0-based indexing
@@ -51,7 +80,11 @@ namespace aam {
   }
 
   void AAMModel::SetImages(const std::vector<QImage> &images) {
-    input_images = images;
+    image_provider = make_shared<InMemoryImageProvider>(images);
+  }
+
+  void AAMModel::SetImageProvider(const shared_ptr<ImageProvider>& provider) {
+    image_provider = provider;
   }
 
   void AAMModel::SetPoints(const std::vector<cv::Mat> &points) {
@@ -70,23 +103,40 @@ namespace aam {
   }
 
   void AAMModel::ProcessImages() {
-    const int nimages = input_images.size();
+    const int nimages = image_provider ? image_provider->size() : 0;
+    if(nimages == 0) return;
+    frame_size = image_provider->ImageSize(0);
+
+    ImageCache::Converter convert;
+    if(keep_8bit_images) {
+      convert = [](const QImage& img) { return QImage2CVMatU(img); };
+    } else {
+      convert = [](const QImage& img) { return QImage2CVMat<TexelScalar>(img); };
+    }
+
+    // In streaming mode images are converted on demand, see GetImage
+    if(streaming) {
+      image_cache.reset(new ImageCache(image_provider, convert, image_budget));
+      return;
+    }
 
     // Convert input images to opencv Mat
     images.resize(nimages);
-    for(int i=0;i<nimages;++i) {
-      images[i] = QImage2CVMat(input_images[i]);
+    ParallelFor(nimages, [&](int i) {
+      images[i] = convert(image_provider->Load(i));
+    }, nthreads);
 
 #if 0
-      // For debugging
-    cv::imshow("image", images[i]);
-    cv::waitKey();
-#endif
+    // For debugging
+    for(int i=0;i<nimages;++i) {
+      cv::imshow("image", images[i]);
+      cv::waitKey();
     }
+#endif
   }
 
   void AAMModel::ProcessShapes() {
-    const int nimages = input_images.size();
+    const int nimages = input_points.size();
     const int npoints = input_points.front().rows;
 
     // Collect all input shapes
@@ -99,7 +149,7 @@ namespace aam {
 #if 0
       // For debugging
     cout << shapes.row(i) << endl;
-    Mat img_i = images[i].clone();
+    Mat img_i = GetTexelImage(i);
     DrawShape(img_i, shapes.row(i));
     cv::imshow("image", img_i);
     cv::waitKey();
@@ -122,12 +172,12 @@ namespace aam {
 #endif
 
     // Compute mean texture
-    meantexture = ComputeMeanTexture(images, shapes, meanshape);
+    meantexture = ComputeMeanTexture(shapes, meanshape);
 
 #if 0
     cv::namedWindow("mean texture", cv::WINDOW_NORMAL);
-  Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-  FillImage(meantexture + 0.5, pixel_coords, img);
+  Mat img(frame_size, texel_type, cv::Scalar(0, 0, 0));
+  FillImage<TexelScalar>(meantexture + 0.5, texel_index, img);
   DrawMesh(img, triangles, meanshape);
   DrawShape(img, meanshape);
   cv::imshow("mean texture", img);
@@ -138,44 +188,33 @@ namespace aam {
   void AAMModel::Preprocess() {
     boost::timer::auto_cpu_timer t("Preprocessing finished in %w seconds.\n");
 
+    if(!image_provider || image_provider->size() == 0 || input_points.empty()) {
+      cerr << "No images to preprocess." << endl;
+      return;
+    }
+
     ProcessImages();
 
     ProcessShapes();
 
     InitializeMeanShapeAndTexture();
+
+    if(pyramid_levels > 0) BuildCoarseLevel();
   }
 
   Mat AAMModel::AlignShape(const Mat& from_shape, const Mat& to_shape) {
-    Mat aligned_shape;
-
-#if 0
-    cout << "from: " << from_shape << endl;
-  cout << "to: " << to_shape << endl;
-  PAUSE();
-#endif
-
-    auto from_points = CVMat2Points(from_shape);
-    auto to_points = CVMat2Points(to_shape);
-
-#if 0
-    Mat tform = cv::estimateRigidTransform(from_points, to_points, false);
-#else
-    Mat tform = EstimateRigidTransform(from_shape, to_shape);
-#endif
+    const int npoints = from_shape.cols / 2;
+    Mat aligned_shape(1, from_shape.cols, CV_64FC1);
 
 #if 0
+    Mat tform = cv::estimateRigidTransform(CVMat2Points(from_shape), CVMat2Points(to_shape), false);
     cout << tform << endl;
-  PAUSE();
-#endif
-
-    cv::transform(from_shape.reshape(2), aligned_shape, tform);
-    aligned_shape = aligned_shape.reshape(1);
-
-#if 0
-    cout << aligned_shape << endl;
-  PAUSE();
 #endif
 
+    // rows of a continuous shapes matrix are contiguous
+    const double* from = from_shape.ptr<double>(0);
+    Similarity2D tform = EstimateSimilarity(from, to_shape.ptr<double>(0), npoints);
+    tform.Apply(from, aligned_shape.ptr<double>(0), npoints);
 
     return aligned_shape;
   }
@@ -218,7 +257,7 @@ namespace aam {
 
   Mat AAMModel::ComputeMeanShape(const Mat& shapes) {
     const int npoints = shapes.cols / 2;
-    const int nimages = images.size();
+    const int nimages = shapes.rows;
 
     const int target_shape_size = 250;
 
@@ -229,13 +268,15 @@ namespace aam {
 
     const int max_iters = 100;
 
+    // Buffers reused by every iteration
+    Mat aligned_shapes(nimages, npoints*2, CV_64FC1);
+    Mat mean_aligned_shape(1, npoints*2, CV_64FC1);
+
     for(int iter=0;iter<max_iters;++iter) {
-      Mat new_meanshape = Mat::zeros(1, npoints*2, CV_64FC1);
-      for(int j=0;j<nimages;++j) {
-        new_meanshape = new_meanshape + AlignShape(shapes.row(j), meanshape);
-      }
-      new_meanshape /= nimages;
-      new_meanshape = ScaleShape(new_meanshape, target_shape_size);
+      // Align all shapes to the current mean shape in one batched pass
+      AlignShapes(shapes, meanshape, aligned_shapes, nthreads);
+      cv::reduce(aligned_shapes, mean_aligned_shape, 0, CV_REDUCE_AVG);
+      Mat new_meanshape = ScaleShape(mean_aligned_shape, target_shape_size);
       double norm = cv::norm(new_meanshape - meanshape);
       cout << "iter " << iter << ": Diff = " << norm << endl;
       meanshape = new_meanshape;
@@ -253,295 +294,479 @@ namespace aam {
     return meanshape;
   }
 
-  Mat AAMModel::ComputeMeanTexture(const vector<Mat>& images,
-                                   const Mat& shapes,
-                                   const Mat& meanshape) {
+  Mat AAMModel::GetImage(int i) const {
+    if(!images.empty()) return images[i];
+    return image_cache->Get(i);
+  }
 
-    const int nimages = images.size();
-    const int npoints = meanshape.cols / 2;
-    const int ntriangles = triangles.size();
-    const int w = images.front().cols;
-    const int h = images.front().rows;
+  // Copy of image i as texel_type, for drawing and dumping
+  Mat AAMModel::GetTexelImage(int i) const {
+    Mat img = GetImage(i);
+    if(img.type() == texel_type) return img.clone();
 
-    auto get_point = [&](const Mat& shape, int idx) {
-      return cv::Point2f(shape.at<double>(0, idx*2),
-                         shape.at<double>(0, idx*2+1));
-    };
+    Mat converted;
+    img.convertTo(converted, texel_type, 1.0 / 255.0);
+    return converted;
+  }
 
-    auto shape_to_verts = [&get_point](const Mat& shape) {
-      const int npoints = shape.cols / 2;
-      vector<cv::Point2f> verts(npoints);
-      for(int i=0;i<npoints;++i) {
-        verts[i] = get_point(shape, i);
-      }
-      return verts;
+  namespace {
+    const char raster_magic[8] = {'A', 'A', 'M', 'R', 'A', 'S', 'T', '\0'};
+    const uint32_t raster_version = 3;
+
+    struct RasterHeader {
+      char magic[8];
+      uint32_t version;
+      int32_t rows, cols, ntriangles;
+      uint64_t key;
     };
 
-    vector<cv::Point2f> meanshape_verts = shape_to_verts(meanshape);
-    vector<vector<cv::Point2f>> shape_verts(nimages);
-    for(int i=0;i<nimages;++i) shape_verts[i] = shape_to_verts(shapes.row(i));
+    // The texel index and the triangles are stored as int32 arrays straight
+    // from their vectors
+    static_assert(sizeof(int) == sizeof(int32_t), "texel index is stored as int32");
+  }
 
-    tforms.resize(nimages, vector<Mat>(ntriangles));
-    tforms_inv.resize(nimages, vector<Mat>(ntriangles));
+  uint64_t AAMModel::RasterCacheKey(const Mat& meanshape) const {
+    Mat ms = meanshape.isContinuous() ? meanshape : meanshape.clone();
+    uint64_t h = HashBytes(ms.data, ms.total() * ms.elemSize());
+    h = HashBytes(triangles.data(), triangles.size() * sizeof(cv::Vec3i), h);
+    const int32_t dims[] = {frame_size.height, frame_size.width};
+    return HashBytes(dims, sizeof(dims), h);
+  }
 
-    for(int j=0;j<ntriangles;++j) {
-      const int vj0 = triangles[j][0];
-      const int vj1 = triangles[j][1];
-      const int vj2 = triangles[j][2];
+  string AAMModel::RasterCacheFilename(uint64_t key) const {
+    std::ostringstream oss;
+    oss << "raster_" << std::hex << key << ".bin";
+    return (fs::path(raster_cache_path) / fs::path(oss.str())).string();
+  }
 
-      cv::Point2f mv0 = meanshape_verts[vj0];
-      cv::Point2f mv1 = meanshape_verts[vj1];
-      cv::Point2f mv2 = meanshape_verts[vj2];
+  // Cache layout: RasterHeader, then the texel index as int32 arrays:
+  // offsets (ntriangles + 1), rows and cols (ntexels each). The float coordinates are rebuilt from rows and cols.
+  bool AAMModel::LoadRasterCache(uint64_t key) {
+    if(raster_cache_path.empty()) return false;
 
-      for(int i=0;i<nimages;++i) {
-        cv::Point2f v0 = get_point(shapes.row(i), vj0);
-        cv::Point2f v1 = get_point(shapes.row(i), vj1);
-        cv::Point2f v2 = get_point(shapes.row(i), vj2);
+    MappedFile file(RasterCacheFilename(key));
+    if(!file.is_open() || file.size() < sizeof(RasterHeader)) return false;
 
-        tforms[i][j] = cv::getAffineTransform(vector<cv::Point2f>{v0, v1, v2},
-                                              vector<cv::Point2f>{mv0, mv1, mv2});
-        cv::invertAffineTransform(tforms[i][j], tforms_inv[i][j]);
-      }
+    const RasterHeader* header = reinterpret_cast<const RasterHeader*>(file.data());
+    const int ntriangles = triangles.size();
+    if(memcmp(header->magic, raster_magic, sizeof(raster_magic)) != 0 ||
+       header->version != raster_version || header->key != key ||
+       header->rows != frame_size.height || header->cols != frame_size.width ||
+       header->ntriangles != ntriangles) {
+      return false;
     }
 
-    // Create pixel map in the texture space
-    auto GeneratePixelMap = [=](const std::vector<cv::Point2f>& verts, const std::vector<cv::Vec3i>& triangles, cv::Mat& pixel_map) {
-      const int ntriangles = triangles.size();
-      pixel_map = Mat(h, w, CV_8UC1, cv::Scalar(0));
-      for(int j=0;j<ntriangles;++j) {
-        const int vj0 = triangles[j][0];
-        const int vj1 = triangles[j][1];
-        const int vj2 = triangles[j][2];
+    const char* p = file.data() + sizeof(RasterHeader);
+    const char* end = file.data() + file.size();
+    if(size_t(end - p) < (ntriangles + 1) * sizeof(int32_t)) return false;
 
-        FillTriangle(pixel_map, verts[vj0], verts[vj1], verts[vj2], cv::Scalar(j+tri_id_offset));
-      }
+    const int32_t* offsets = reinterpret_cast<const int32_t*>(p);
+    p += (ntriangles + 1) * sizeof(int32_t);
+
+    if(offsets[ntriangles] < 0) return false;
+    const size_t ntexels = offsets[ntriangles];
+    if(size_t(end - p) / (2 * sizeof(int32_t)) < ntexels) return false;
+
+    const int32_t* rows = reinterpret_cast<const int32_t*>(p);
+    const int32_t* cols = rows + ntexels;
+    TexelIndex index;
+    index.offsets.assign(offsets, offsets + ntriangles + 1);
+    index.rows.assign(rows, rows + ntexels);
+    index.cols.assign(cols, cols + ntexels);
+
+    // A foreign or damaged file would otherwise turn into writes outside the frame
+    if(!index.IsValid(ntriangles, frame_size)) return false;
+
+    texel_index = std::move(index);
+    texel_index.UpdateCoordinates();
+
+    cout << "Loaded texture raster from " << RasterCacheFilename(key) << endl;
+    return true;
+  }
+
+  void AAMModel::SaveRasterCache(uint64_t key) const {
+    if(raster_cache_path.empty()) return;
+
+    RasterHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, raster_magic, sizeof(raster_magic));
+    header.version = raster_version;
+    header.rows = frame_size.height;
+    header.cols = frame_size.width;
+    header.ntriangles = triangles.size();
+    header.key = key;
+
+    fs::create_directories(fs::path(raster_cache_path));
+    AtomicWriteFile(RasterCacheFilename(key), [&](ofstream& fout) {
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      fout.write(reinterpret_cast<const char*>(texel_index.offsets.data()), texel_index.offsets.size() * sizeof(int32_t));
+      fout.write(reinterpret_cast<const char*>(texel_index.rows.data()), texel_index.rows.size() * sizeof(int32_t));
+      fout.write(reinterpret_cast<const char*>(texel_index.cols.data()), texel_index.cols.size() * sizeof(int32_t));
+    });
+  }
+
+  bool AAMModel::SaveModel(const string& filename) const {
+    auto int_row = [](const vector<int>& v) {
+      return Mat(1, v.size(), CV_32SC1, const_cast<int*>(v.data()));
     };
 
-    GeneratePixelMap(meanshape_verts, triangles, pixel_map);
-#if 0
-    cv::imshow("mean pixel map", pixel_map);
-    cv::waitKey();
-#endif
+    vector<Mat> sections(ModelFile::NumSections);
+    sections[ModelFile::MeanShape] = meanshape;
+    sections[ModelFile::Triangles] = Mat(triangles.size(), 3, CV_32SC1, const_cast<cv::Vec3i*>(triangles.data()));
+    sections[ModelFile::TexelOffsets] = int_row(texel_index.offsets);
+    sections[ModelFile::TexelRows] = int_row(texel_index.rows);
+    sections[ModelFile::TexelCols] = int_row(texel_index.cols);
+    sections[ModelFile::MeanTexture] = meantexture;
+    sections[ModelFile::ShapeMean] = shape_model.mean;
+    sections[ModelFile::ShapeEigenvalues] = shape_model.eigenvalues;
+    sections[ModelFile::ShapeEigenvectors] = shape_model.eigenvectors;
+    sections[ModelFile::TextureMean] = texture_model.mean;
+    sections[ModelFile::TextureEigenvalues] = texture_model.eigenvalues;
+    sections[ModelFile::TextureEigenvectors] = texture_model.eigenvectors;
+
+    if(!SaveModelFile(filename, frame_size, sections)) return false;
+    cout << "Saved model to " << filename << endl;
+    return true;
+  }
 
-    inv_pixel_maps.resize(nimages);
-    for(int i=0;i<nimages;++i) {
-      GeneratePixelMap(shape_verts[i], triangles, inv_pixel_maps[i]);
-#if 0
-      cv::imshow("pixel map", inv_pixel_maps[i]);
-      cv::waitKey();
-#endif
+  bool AAMModel::LoadModel(const string& filename) {
+    boost::timer::auto_cpu_timer t("Model loaded in %w seconds.\n");
+
+    shared_ptr<ModelFile> file = make_shared<ModelFile>();
+    if(!file->Open(filename)) {
+      cerr << "Failed to open model " << filename << endl;
+      return false;
     }
 
-    // Count the number of pixels we need to process
-    auto collect_pixel_info = [=](const Mat& pix_map,
-                                  vector<int>& pix_counts,
-                                  vector<vector<cv::Vec2i>>& pix_coords,
-                                  vector<Mat>& pix_mats){
-      pix_counts.resize(ntriangles, 0);
-      pix_coords.resize(ntriangles);
-      for (int i = 0; i < h; ++i) {
-        for (int j = 0; j < w; ++j) {
-          int tri_id = static_cast<int>(pix_map.at<unsigned char>(i, j)) - tri_id_offset;
-          if (tri_id >= 0) {
-            ++pix_counts[tri_id];
-            pix_coords[tri_id].push_back(cv::Vec2i(i, j));
-          }
-        }
-      }
+    // The texture matrices are used in place, they must already be texel_type
+    Mat mt = file->Get(ModelFile::MeanTexture);
+    Mat texture_mean = file->Get(ModelFile::TextureMean);
+    Mat texture_eigenvalues = file->Get(ModelFile::TextureEigenvalues);
+    Mat texture_eigenvectors = file->Get(ModelFile::TextureEigenvectors);
+    if(mt.type() != texel_type || texture_eigenvectors.depth() != cv::DataType<TexelScalar>::depth) {
+      cerr << "Model " << filename << " was built with a different texel precision" << endl;
+      return false;
+    }
 
-      // Create the list of points we need to project back/forward
-      pix_mats.resize(ntriangles);
-      for(int j=0;j<ntriangles;++j) {
-        pix_mats[j] = cv::Mat(pix_counts[j], 2, CV_32FC1);
-        for(int k=0;k<pix_counts[j];++k) {
-          auto pix_coord = pix_coords[j][k];
-          pix_mats[j].at<float>(k, 0) = pix_coord[1];
-          pix_mats[j].at<float>(k, 1) = pix_coord[0];
-        }
-      }
+    // Every section must have the type and shape SaveModel gives it before
+    // anything is read through it, the texel index is checked against the
+    // frame below
+    auto is_row = [](const Mat& m, int type, int cols) {
+      return m.type() == type && m.rows == 1 && m.cols == cols;
+    };
+    auto is_model = [&](const Mat& mean, const Mat& eigenvalues, const Mat& eigenvectors, int depth, int cols) {
+      return is_row(mean, CV_MAKETYPE(depth, 1), cols) &&
+             eigenvectors.type() == CV_MAKETYPE(depth, 1) && eigenvectors.cols == cols &&
+             eigenvalues.type() == CV_MAKETYPE(depth, 1) && eigenvalues.cols == 1 &&
+             eigenvalues.rows == eigenvectors.rows;
     };
 
-    collect_pixel_info(pixel_map, pixel_counts, pixel_coords, pixel_mats);
+    Mat ms = file->Get(ModelFile::MeanShape);
+    Mat tris = file->Get(ModelFile::Triangles), offsets = file->Get(ModelFile::TexelOffsets);
+    Mat texel_rows = file->Get(ModelFile::TexelRows), texel_cols = file->Get(ModelFile::TexelCols);
+    const int npoints = ms.cols / 2, ntexels = mt.cols;
+    bool consistent = ms.type() == CV_64FC1 && ms.rows == 1 && ms.cols % 2 == 0 && npoints >= 3 &&
+                      tris.type() == CV_32SC1 && tris.cols == 3 && tris.rows > 0 &&
+                      is_row(offsets, CV_32SC1, tris.rows + 1) &&
+                      is_row(texel_rows, CV_32SC1, ntexels) && is_row(texel_cols, CV_32SC1, ntexels) &&
+                      mt.rows == 1 &&
+                      is_model(file->Get(ModelFile::ShapeMean), file->Get(ModelFile::ShapeEigenvalues),
+                               file->Get(ModelFile::ShapeEigenvectors), CV_64F, ms.cols) &&
+                      is_model(texture_mean, texture_eigenvalues, texture_eigenvectors,
+                               cv::DataType<TexelScalar>::depth, ntexels * 3);
+    for(int j=0;consistent && j<tris.rows;++j) {
+      const int32_t* v = tris.ptr<int32_t>(j);
+      for(int k=0;k<3;++k) consistent = consistent && v[k] >= 0 && v[k] < npoints;
+    }
 
-    inv_pixel_mats.resize(nimages);
-    inv_pixel_counts.resize(nimages);
-    inv_pixel_coords.resize(nimages);
-    for(int i=0;i<nimages;++i) collect_pixel_info(inv_pixel_maps[i], inv_pixel_counts[i], inv_pixel_coords[i], inv_pixel_mats[i]);
+    // The texel index is small, copy it and rebuild the derived arrays once
+    // it is known to stay inside the frame
+    TexelIndex index;
+    if(consistent) {
+      const int32_t* o = offsets.ptr<int32_t>();
+      const int32_t* r = texel_rows.ptr<int32_t>();
+      const int32_t* c = texel_cols.ptr<int32_t>();
+      index.offsets.assign(o, o + offsets.cols);
+      index.rows.assign(r, r + ntexels);
+      index.cols.assign(c, c + ntexels);
+      consistent = index.IsValid(tris.rows, file->FrameSize());
+    }
+    if(!consistent) {
+      cerr << "Model " << filename << " is inconsistent" << endl;
+      return false;
+    }
 
-    // Create image space points to texture space points mapping
-    inv_pixel_pts.resize(nimages, vector<Mat>(ntriangles));
-    for(int i=0;i<nimages;++i) {
-#if 0
-      Mat img(h, w, CV_64FC3, cv::Scalar(0, 0, 0));
-#endif
-      for(int j=0;j<ntriangles;++j) {
-        if(inv_pixel_mats[i][j].rows == 0) {
-          continue;
-        }
+    model_file = file;
+    frame_size = file->FrameSize();
+    meanshape = ms;
+    meantexture = mt;
 
-        // project the points from input image to texture space
-        cv::Mat pts;
-        cv::transform(inv_pixel_mats[i][j].reshape(2), pts, tforms[i][j]);
-        pts = pts.reshape(1, 1);
+    const cv::Vec3i* t_begin = reinterpret_cast<const cv::Vec3i*>(tris.data);
+    triangles.assign(t_begin, t_begin + tris.rows);
 
-        inv_pixel_pts[i][j] = pts;
+    texel_index = std::move(index);
+    texel_index.UpdateCoordinates();
+    texel_index.ComputeBarycentrics(CVMat2Points(meanshape), triangles);
 
-#if 0
-        for(int k=0;k<inv_pixel_mats[i][j].rows;++k) {
-          cv::circle(img, cv::Point(inv_pixel_mats[i][j].at<float>(k, 0),
-                                    inv_pixel_mats[i][j].at<float>(k, 1)),
-          1, cv::Scalar(0, 255, 0));
-        }
-#endif
-      }
-#if 0
-      cv::imshow("pixel map", inv_pixel_maps[i]);
-      cv::imshow("source points", img);
-      cv::waitKey();
-#endif
-    }
+    shape_model.mean = file->Get(ModelFile::ShapeMean);
+    shape_model.eigenvalues = file->Get(ModelFile::ShapeEigenvalues);
+    shape_model.eigenvectors = file->Get(ModelFile::ShapeEigenvectors);
+    texture_model.mean = texture_mean;
+    texture_model.eigenvalues = texture_eigenvalues;
+    texture_model.eigenvectors = texture_eigenvectors;
 
-    // Warp the input images to the meanshape space
-    warped_images.resize(nimages);
+    cout << "Loaded model with " << shape_model.eigenvectors.rows << " shape and "
+         << texture_model.eigenvectors.rows << " texture components from " << filename << endl;
+    return true;
+  }
 
-    for(int i=0;i<nimages;++i) {
-#if 0
-      warped_images[i] = Mat(h, w, CV_64FC3, cv::Scalar(0, 0, 0));
-      for(int j=0;j<ntriangles;++j) {
-        // project back the points to input image space
-        cv::Mat pts;
-        cv::transform(pixel_mats[j].reshape(2), pts, tforms_inv[i][j]);
-        pts = pts.reshape(1, 1);
+  Mat AAMModel::ScoreImages(const vector<Mat>& images, const vector<Mat>& points) const {
+    assert(images.size() == points.size());
+    const int nimages = images.size();
 
-        for(int k=0;k<pixel_counts[j];++k) {
-          auto pix_coord = pixel_coords[j][k];
+    Mat sample_textures(nimages, texel_index.size(), texel_type);
+    ParallelFor(nimages, [&](int i) {
+      Mat shape = points[i].reshape(1, 1);
+      if(!shape.isContinuous()) shape = shape.clone();
+      assert(shape.type() == CV_64FC1 && shape.cols == meanshape.cols);
+      WarpImageToTexture<TexelScalar>(images[i], shape, triangles, texel_index, sample_textures.ptr<Texel>(i));
+    }, nthreads);
+
+    vector<int> rows(nimages);
+    std::iota(rows.begin(), rows.end(), 0);
+    vector<double> alphas;
+    vector<cv::Vec3d> betas;
+    Mat normalized = NormalizeSamples(rows, sample_textures, meantexture, alphas, betas);
+    return ProjectRows(texture_model, normalized.reshape(1), nullptr, nullptr, nthreads);
+  }
 
-          cv::Vec3d sample = SampleImage(images[i], cv::Point2f(pts.at<float>(0,k*2), pts.at<float>(0,k*2+1)));
+  void AAMModel::ComputeInversePixelInfo(int i, TexelIndex& index) const {
+    index.Build(CVMat2Points(shapes.row(i)), triangles, frame_size);
+  }
 
-          warped_images[i].at<cv::Vec3d>(pix_coord[0], pix_coord[1]) = sample;
-        }
-      }
-#else
-      warped_images[i] = WarpImage(images[i], tforms_inv[i], pixel_mats, pixel_coords);
-#endif
+  double AAMModel::ComputeFittingError(int i, const Mat& reconstruction, Mat& warp_back,
+                                       Mat* frame) const {
+    // Warp reconstructed back to image space and compute fitting error using the pixel mask.
+    // FillImage only writes the texels of texel_index, so the pixels outside
+    // the mesh of a reused frame are still zero.
+    Mat local;
+    Mat& fitted = frame != nullptr ? *frame : local;
+    if(fitted.rows != frame_size.height || fitted.cols != frame_size.width || fitted.type() != texel_type) {
+      fitted = Mat(frame_size, texel_type, cv::Scalar(0, 0, 0));
+    }
+    FillImage<TexelScalar>(reconstruction, texel_index, fitted);
 
-#if 0
-      cout << i << endl;
-      cout << tforms.size() << ", " << inv_pixel_mats.size() << ", " << inv_pixel_coords.size() << endl;
-      cv::imshow("warped", warped_images[i]);
-      Mat warp_back = WarpImage(warped_images[i], tforms[i], inv_pixel_mats[i], inv_pixel_coords[i]);
-      cv::imshow("warped back", warp_back);
-      cv::waitKey();
-#endif
+    if(!streaming) {
+      warp_back = WarpImage<TexelScalar>(fitted, tforms[i], inv_texel_indices[i]);
+      return ComputeRMSE<TexelScalar>(warp_back, images[i], inv_texel_indices[i]);
     }
 
-    // Put all texels into a Mat
-    int ntexels = accumulate(pixel_counts.begin(), pixel_counts.end(), 0);
-    textures = Mat(nimages, ntexels, CV_64FC3);
-    for(int i=0;i<nimages;++i) {
-      int offset = 0;
-      for(int j=0;j<pixel_counts.size();++j) {
-        for(int k=0;k<pixel_coords[j].size();++k) {
-          // collect the texels
-          auto pix_coord = pixel_coords[j][k];
-          textures.at<cv::Vec3d>(i, offset+k) = warped_images[i].at<cv::Vec3d>(pix_coord[0], pix_coord[1]);
-        }
-        offset += pixel_counts[j];
-      }
+    // Re-materialise the image and its texel index for this sample only
+    TexelIndex index;
+    ComputeInversePixelInfo(i, index);
+    warp_back = WarpImage<TexelScalar>(fitted, tforms[i], index);
+    return ComputeRMSE<TexelScalar>(warp_back, GetImage(i), index);
+  }
+
+  Mat AAMModel::ComputeMeanTexture(const Mat& shapes, const Mat& meanshape) {
+    const int nimages = shapes.rows;
+    const int ntriangles = triangles.size();
+
+    vector<cv::Point2f> meanshape_verts = CVMat2Points(meanshape);
+
+    // Rasterize the mesh in the texture space, unless an earlier run with the
+    // same mean shape, triangulation and frame size left it in the cache
+    const uint64_t raster_key = RasterCacheKey(meanshape);
+    if(!LoadRasterCache(raster_key)) {
+      texel_index.Build(meanshape_verts, triangles, frame_size);
+      SaveRasterCache(raster_key);
     }
 
+    // Texel positions in the mean shape never change, their barycentric
+    // coordinates locate them in every input image
+    texel_index.ComputeBarycentrics(meanshape_verts, triangles);
+
+    const int ntexels = texel_index.size();
+    textures = Mat(nimages, ntexels, texel_type);
+    tforms.assign(nimages, vector<Mat>(ntriangles));
+    // The texel indices in image space are only needed to compute the
+    // fitting error, the streaming mode recomputes them on demand instead
+    inv_texel_indices.assign(streaming ? 0 : nimages, TexelIndex());
+
+    // The per-image stages are independent, run them in one pass per image on
+    // the worker pool. Every image only writes its own slots, so the results
+    // do not depend on the scheduling.
+    PerThread<vector<cv::Point2f>> verts_scratch;
+    ParallelFor(nimages, [&](int i) {
+      // Affine transformations from the triangles of the image to the mean
+      // shape, used to warp reconstructions back for the fitting error. The
+      // forward warp goes through the barycentric table instead.
+      vector<cv::Point2f>& verts = verts_scratch.local();
+      CVMat2Points(shapes.row(i), verts);
+      for(int j=0;j<ntriangles;++j) {
+        const int vj0 = triangles[j][0];
+        const int vj1 = triangles[j][1];
+        const int vj2 = triangles[j][2];
+
+        const cv::Point2f src[] = {verts[vj0], verts[vj1], verts[vj2]};
+        const cv::Point2f dst[] = {meanshape_verts[vj0], meanshape_verts[vj1], meanshape_verts[vj2]};
+        tforms[i][j] = cv::getAffineTransform(src, dst);
+      }
+
+      if(!streaming) inv_texel_indices[i].Build(verts, triangles, frame_size);
+
+      // Warp the input image to the meanshape space, straight into its row of
+      // the texture matrix. In streaming mode the image is converted, warped
+      // and released, so only the texture rows stay resident.
+      WarpImageToTexture<TexelScalar>(GetImage(i), shapes.row(i), triangles, texel_index, textures.ptr<Texel>(i));
+    }, nthreads);
+
 #if 0
-    Mat mean_warped_image(h, w, CV_64FC3, cv::Scalar(0, 0, 0));
     for(int i=0;i<nimages;++i) {
-      mean_warped_image += warped_images[i];
-      cout << i << endl;
-      cv::imshow("warped", warped_images[i]);
-      cv::imshow("meantexture", mean_warped_image / (i+1));
+      Mat warped(frame_size, texel_type, cv::Scalar(0, 0, 0));
+      FillImage<TexelScalar>(textures.row(i), texel_index, warped);
+      cv::imshow("warped", warped);
       cv::waitKey();
     }
-    mean_warped_image /= nimages;
 #endif
 
+    return NormalizeTextures(textures, normalized_textures);
+  }
+
+  // Estimates the mean texture of the rows of textures together with their
+  // normalization against it, normalized_textures receives the normalized
+  // rows with the mean subtracted
+  Mat AAMModel::NormalizeTextures(const Mat& textures, Mat& normalized_textures) const {
+    typedef Eigen::Matrix<TexelScalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+    typedef Eigen::Matrix<TexelScalar, Eigen::Dynamic, 1> Vector;
+
+    const int nimages = textures.rows;
+    const int ntexels = textures.cols;
+    const int n = ntexels * 3;  // scalars per texture
+
+    assert(textures.isContinuous());
+    Eigen::Map<const RowMatrix> T(textures.ptr<TexelScalar>(0), nimages, n);
+
     Mat meantexture;
     cv::reduce(textures, meantexture, 0, CV_REDUCE_AVG);
+    Eigen::Map<Vector> m(meantexture.ptr<TexelScalar>(0), n);
+
+    // Sample i normalized against the mean m is (t_i - beta_i) / (m . t_i),
+    // see NormalizeTexture. The offsets beta_i do not depend on m, so they are
+    // computed once and the new mean is
+    //   1/N * (T^T w - sum_i w_i beta_i),  w_i = 1 / (m . t_i)
+    // Every iteration is then the GEMV T m plus the weighted row sum T^T w,
+    // no texture row is normalized or written until the mean is settled.
+    vector<cv::Vec3d> betas(nimages);
+    for(int i=0;i<nimages;++i) {
+      for(int s=0;s<3;++s) {
+        betas[i][s] = T.row(i).segment(s * ntexels, ntexels).cast<double>().sum() / ntexels;
+      }
+    }
 
     // Iteratively compute the mean texture
     const int max_iters = 100;
-    normalized_textures = Mat(nimages, ntexels, CV_64FC3);
+    Vector alphas(nimages), weights(nimages), newmeantexture(n);
 
     for(int iter=0;iter<max_iters;++iter) {
-      Mat newmeantexture(1, ntexels, CV_64FC3, cv::Scalar(0, 0, 0));
+      alphas.noalias() = T * m;
+
+      cv::Vec3d offset(0, 0, 0);
       for(int i=0;i<nimages;++i) {
-        auto normalization_res = NormalizeTextureVec(textures.row(i), meantexture);
-        normalized_textures.row(i) = std::get<0>(normalization_res)*1;
-        newmeantexture += normalized_textures.row(i);
+        weights(i) = 1.0 / alphas(i);
+        offset += betas[i] * static_cast<double>(weights(i));
+      }
+
+      newmeantexture.noalias() = T.transpose() * weights;
+      for(int s=0;s<3;++s) {
+        newmeantexture.segment(s * ntexels, ntexels).array() -= static_cast<TexelScalar>(offset[s]);
       }
       newmeantexture /= nimages;
 
-      double diff_iter = cv::norm(newmeantexture - meantexture);
-      printf("iter %d: %.6f, %.6f\n", iter, diff_iter, cv::norm(newmeantexture));
+      double diff_iter = (newmeantexture - m).norm();
+      printf("iter %d: %.6f, %.6f\n", iter, diff_iter, static_cast<double>(newmeantexture.norm()));
       if(diff_iter < 1e-6) break;
-      const double lambda = 0.75;
-      meantexture = lambda * newmeantexture + (1.0 - lambda) * meantexture;
+      const TexelScalar lambda = 0.75;
+      m = lambda * newmeantexture + (1 - lambda) * m;
     }
 
-    // subtract mean texture from the normalized textures
-    for(int i=0;i<nimages;++i) normalized_textures.row(i) -= meantexture;
+    // Normalize against the final mean and subtract it
+    normalized_textures = Mat(nimages, ntexels, texel_type);
+    ParallelFor(nimages, [&](int i) {
+      Mat normalized_i = normalized_textures.row(i);
+      cv::Vec3d beta_i;
+      NormalizeTextureVec<TexelScalar>(textures.row(i), meantexture, normalized_i, beta_i);
+      normalized_i -= meantexture;
+    }, nthreads);
 
     return meantexture;
   }
 
+  // Rows of textures at indices normalized against meantexture, which is then
+  // subtracted, as the rows of one matrix. The scales and offsets of each
+  // row are returned to unnormalize reconstructions.
+  Mat AAMModel::NormalizeSamples(const vector<int>& indices,
+                                 const Mat& textures,
+                                 const Mat& meantexture,
+                                 vector<double>& alphas,
+                                 vector<cv::Vec3d>& betas) const {
+    const int nsamples = indices.size();
+    Mat normalized(nsamples, textures.cols, textures.type());
+    alphas.resize(nsamples);
+    betas.resize(nsamples);
+
+    ParallelFor(nsamples, [&](int i) {
+      Mat normalized_i = normalized.row(i);
+      alphas[i] = NormalizeTextureVec<TexelScalar>(textures.row(indices[i]), meantexture, normalized_i, betas[i]);
+      normalized_i -= meantexture;
+    }, nthreads);
+
+    return normalized;
+  }
+
   void AAMModel::BuildModel(vector<int> indices) {
     if(indices.empty()) {
-      indices.resize(input_images.size());
+      indices.resize(shapes.rows);
       std::iota(indices.begin(), indices.end(), 0);
     }
 
     int nimages = indices.size();
 
     // Construct shape and texture model with the provided indices
-    cv::PCA shape_model, texture_model;
     {
       boost::timer::auto_cpu_timer t("Shape model constructed in %w seconds.\n");
-      shape_model = shape_model(shapes, Mat(), CV_PCA_DATA_AS_ROW, 0.98);
+      shape_model = ComputePCA(shapes, 0.98, pca_options);
     }
     {
       boost::timer::auto_cpu_timer t("Texture model constructed in %w seconds.\n");
-      texture_model = texture_model(normalized_textures.reshape(1), Mat(), CV_PCA_DATA_AS_ROW, 0.98);
+      texture_model = ComputePCA(normalized_textures.reshape(1), 0.98, pca_options);
     }
 
-    Mat diffs(1, nimages, CV_64FC1);
-    vector<Mat> reconstructions(nimages);
-    for(int i=0;i<nimages;++i) {
-      Mat coeffs(1, texture_model.mean.cols, texture_model.mean.type()), reconstructed;
-      Mat vec = textures.row(i);
-
-      // normalize it
-      Mat normalized_vec, beta_i;
-      double alpha_i;
+    // Normalize the samples and project them all at once
+    vector<int> rows(nimages);
+    std::iota(rows.begin(), rows.end(), 0);
+    vector<double> alphas;
+    vector<cv::Vec3d> betas;
+    Mat normalized = NormalizeSamples(rows, textures, meantexture, alphas, betas);
 
-      tie(normalized_vec, alpha_i, beta_i) = NormalizeTextureVec(vec, meantexture);
-      normalized_vec -= meantexture;
-
-      texture_model.project(normalized_vec.reshape(1), coeffs);
-      texture_model.backProject(coeffs, reconstructed);
-      reconstructed = reconstructed.reshape(3);
-
-      diffs.at<double>(0, i) = cv::norm(normalized_vec, reconstructed, cv::NORM_L2);
+    Mat reconstructed;
+    Mat diffs = ProjectRows(texture_model, normalized.reshape(1), &reconstructed, nullptr, nthreads);
 
+    vector<Mat> reconstructions(nimages);
+    for(int i=0;i<nimages;++i) {
       // unnormalize it
-      reconstructed = (reconstructed + meantexture) * alpha_i + beta_i.reshape(3, 1);
+      reconstructions[i] = reconstructed.row(i).reshape(3) + meantexture;
+      DenormalizeTextureVec<TexelScalar>(reconstructions[i], alphas[i], betas[i]);
 
-      reconstructions[i] = reconstructed;
       printf("%d. diff = %g\n", i, diffs.at<double>(0, i));
 
 #if 1
-      cv::Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-      FillImage(reconstructions[i], pixel_coords, img);
+      cv::Mat img(frame_size, texel_type, cv::Scalar(0, 0, 0));
+      FillImage<TexelScalar>(reconstructions[i], texel_index, img);
       cv::imshow("outlier", img);
 
-      cv::Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-      FillImage(textures.row(i), pixel_coords, img_ref);
+      cv::Mat img_ref(frame_size, texel_type, cv::Scalar(0, 0, 0));
+      FillImage<TexelScalar>(textures.row(i), texel_index, img_ref);
       cv::imshow("ref", img_ref);
       cv::waitKey();
 #endif
@@ -556,121 +781,110 @@ namespace aam {
       if(diffs.at<double>(0, i) >= mean_diff[0] + 3 * stddev_diff[0]) {
         int max_idx = i;
         // Fill the image
-        cv::Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(reconstructions[max_idx], pixel_coords, img);
+        cv::Mat img(frame_size, texel_type, cv::Scalar(0, 0, 0));
+        FillImage<TexelScalar>(reconstructions[max_idx], texel_index, img);
         cv::imshow("outlier", img);
 
-        cv::Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(textures.row(max_idx) + meantexture, pixel_coords, img_ref);
+        cv::Mat img_ref(frame_size, texel_type, cv::Scalar(0, 0, 0));
+        FillImage<TexelScalar>(textures.row(max_idx) + meantexture, texel_index, img_ref);
         cv::imshow("ref", img_ref);
         cv::waitKey();
       }
     }
   }
 
+  // Writes the input image, the fitted image, the reconstructed and the
+  // warped texture of a sample to the inliers or outliers folder
+  void AAMModel::DumpSample(int idx, bool outlier, const Mat& reconstruction, const Mat& fitted) const {
+    const string prefix = output_path + (outlier ? "/outliers/" : "/inliers/") + "image" + to_string(idx);
+
+    Mat img_i = GetTexelImage(idx);
+    DrawShape(img_i, shapes.row(idx));
+    cv::imwrite(prefix + ".jpg", img_i * 255);
+
+    cv::imwrite(prefix + "_fitted.jpg", fitted * 255);
+
+    Mat img(frame_size, texel_type, cv::Scalar(0, 0, 0));
+    FillImage<TexelScalar>(reconstruction, texel_index, img);
+    cv::imwrite(prefix + "_fitted_tex.jpg", img * 255);
+
+    Mat img_ref(frame_size, texel_type, cv::Scalar(0, 0, 0));
+    FillImage<TexelScalar>(textures.row(idx) + meantexture, texel_index, img_ref);
+    cv::imwrite(prefix + "_warped.jpg", img_ref * 255);
+  }
+
   vector<int> AAMModel::FindInliers(vector<int> indices) {
     if(indices.empty()) {
-      indices.resize(input_images.size());
+      indices.resize(shapes.rows);
       std::iota(indices.begin(), indices.end(), 0);
     }
 
     int nimages = indices.size();
 
-    set<int> current_set(indices.begin(), indices.end());
-
     vector<Mat> reconstructions(nimages), fitted_images(nimages);
     Mat diffs(1, nimages, CV_64FC1);
 
-    #pragma omp parallel for
-    for(int i=0;i<indices.size();++i) {
-      cout << i << endl;
-      set<int> set_i = current_set;
-      set_i.erase(indices[i]);
-
-      Mat shapes_i(set_i.size(), shapes.cols, shapes.type()),
-        normalized_textures_i(set_i.size(), normalized_textures.cols, normalized_textures.type());
-
-      int ridx = 0;
-      for(auto j : set_i) {
-        shapes_i.row(ridx) = shapes.row(j) * 1;
-        normalized_textures_i.row(ridx) = normalized_textures.row(j) * 1;
-        ++ridx;
-      }
-      Mat normalized_textures_i_reshaped = normalized_textures_i.reshape(1);
+    // The texture models without each sample all come out of one
+    // decomposition of the set, see LeaveOneOutResiduals
+    Mat normalized_textures_set(nimages, normalized_textures.cols, normalized_textures.type());
+    for(int i=0;i<nimages;++i) normalized_textures.row(indices[i]).copyTo(normalized_textures_set.row(i));
 
-      // Construct shape and texture model with the provided indices
-      cv::PCA shape_model, texture_model;
-      {
-        boost::timer::auto_cpu_timer t("Shape model constructed in %w seconds.\n");
-        shape_model = shape_model(shapes_i, Mat(), CV_PCA_DATA_AS_ROW, 0.98);
-      }
-      {
-        boost::timer::auto_cpu_timer t("Texture model constructed in %w seconds.\n");
-        texture_model = texture_model(normalized_textures_i_reshaped,
-                                      Mat(),
-                                      CV_PCA_DATA_AS_ROW,
-                                      0.98);
-      }
-
-      PrintShape(texture_model.eigenvectors);
+    Mat texture_errors, reconstructed;
+    {
+      boost::timer::auto_cpu_timer t("Leave-one-out texture models constructed in %w seconds.\n");
+      texture_errors = LeaveOneOutResiduals(normalized_textures_set.reshape(1), 0.98, &reconstructed, nthreads);
+    }
 
-      Mat coeffs(1, texture_model.mean.cols, texture_model.mean.type()), reconstructed;
+    PerThread<Mat> frames;
+    ParallelFor(nimages, [&](int i) {
       Mat vec = textures.row(indices[i]);
 
-      // normalize it
-      Mat normalized_vec, beta_i;
-      double alpha_i;
-      tie(normalized_vec, alpha_i, beta_i) = NormalizeTextureVec(vec, meantexture);
-      // subtract meantexture since the PCA model is built on difference
-      normalized_vec -= meantexture;
-
-      texture_model.project(normalized_vec.reshape(1), coeffs);
-      texture_model.backProject(coeffs, reconstructed);
-      reconstructed = reconstructed.reshape(3);
+      // normalization of the sample, to unnormalize its reconstruction
+      Mat normalized_vec;
+      cv::Vec3d beta_i;
+      const double alpha_i = NormalizeTextureVec<TexelScalar>(vec, meantexture, normalized_vec, beta_i);
 
       // unnormalize it
-      reconstructions[i] = (reconstructed + meantexture) * alpha_i + beta_i.reshape(3, 1);
+      reconstructions[i] = reconstructed.row(i).reshape(3) + meantexture;
+      DenormalizeTextureVec<TexelScalar>(reconstructions[i], alpha_i, beta_i);
 
-      Mat fitted, warp_back;
       switch(metric) {
         case TextureError: {
-          diffs.at<double>(0, i) = cv::norm(normalized_vec, reconstructed, cv::NORM_L2);
+          diffs.at<double>(0, i) = texture_errors.at<double>(0, i);
           break;
         }
         case FittingError: {
-          // Warp reconstructed back to image space and compute fitting error using the pixel mask
-          double diff_i = 0;
-          cout << "warping image ..." << endl;
-          fitted = Mat(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-          FillImage(reconstructions[i], pixel_coords, fitted);
-          warp_back = WarpImage(fitted, tforms[indices[i]], inv_pixel_mats[indices[i]], inv_pixel_coords[indices[i]]);
+          Mat warp_back;
+          diffs.at<double>(0, i) = ComputeFittingError(indices[i], reconstructions[i], warp_back, &frames.local());
           fitted_images[i] = warp_back;
-          diffs.at<double>(0, i) = ComputeRMSE(warp_back, images[indices[i]], inv_pixel_coords[indices[i]]);
           break;
         }
         default:
           break;
       }
+    }, nthreads);
 
+    // Printed after the loop so the lines come out whole and in order
+    for(int i=0;i<nimages;++i) {
       printf("%d. diff = %g\n", i, diffs.at<double>(0, i));
 
-#if 0
-      cv::imshow("fitted", fitted);
+    #if 0
+      Mat warp_back = fitted_images[i].clone();
 
-      cv::Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-      FillImage(textures.row(indices[i]), pixel_coords, img_ref);
+      cv::Mat img_ref(frame_size, texel_type, cv::Scalar(0, 0, 0));
+      FillImage<TexelScalar>(textures.row(indices[i]), texel_index, img_ref);
       cv::imshow("ref", img_ref);
 
-      Mat image_i = images[indices[i]].clone();
+      Mat image_i = GetTexelImage(indices[i]);
       DrawShape(image_i, shapes.row(indices[i]));
-      cv::imshow("input", images[indices[i]]);
+      cv::imshow("input", image_i);
 
       cv::putText(warp_back, std::to_string(diffs.at<double>(0, i)), cv::Point(5, 20),
                   cv::FONT_HERSHEY_SIMPLEX, 0.35, cv::Scalar(255, 175, 175));
       cv::imshow("warp_back", warp_back);
 
       cv::waitKey();
-#endif
+    #endif
     }
 
     cv::Scalar mean_diff, stddev_diff;
@@ -687,37 +901,10 @@ namespace aam {
 
       if(diffs.at<double>(0, i) >= mean_diff[0] + 2 * stddev_diff[0]) {
         cout << "outlier: " << max_idx << endl;
-        Mat img_i = images[max_idx].clone();
-        DrawShape(img_i, shapes.row(max_idx));
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + ".jpg", img_i * 255);
-
-        Mat img_fitted = fitted_images[i];
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + "_fitted.jpg", img_fitted * 255);
-
-        Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(reconstructions[i], pixel_coords, img);
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + "_fitted_tex.jpg", img * 255);
-
-        Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(textures.row(max_idx) + meantexture, pixel_coords, img_ref);
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + "_warped.jpg", img_ref * 255);
+        DumpSample(max_idx, true, reconstructions[i], fitted_images[i]);
       } else {
         res.insert(indices[i]);
-
-        Mat img_i = images[max_idx].clone();
-        DrawShape(img_i, shapes.row(max_idx));
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + ".jpg", img_i * 255);
-
-        Mat img_fitted = fitted_images[i];
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + "_fitted.jpg", img_fitted * 255);
-
-        Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(reconstructions[i], pixel_coords, img);
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + "_fitted_tex.jpg", img * 255);
-
-        Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(textures.row(max_idx) + meantexture, pixel_coords, img_ref);
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + "_warped.jpg", img_ref * 255);
+        DumpSample(max_idx, false, reconstructions[i], fitted_images[i]);
       }
     }
 
@@ -728,6 +915,10 @@ namespace aam {
 
   std::vector<int> AAMModel::FindInliers_Iterative(vector<int> indices, Method method) {
     boost::timer::auto_cpu_timer t("Outlier detection finished in %w seconds.\n");
+
+    // Iterates on its own, on the coarse level
+    if(method == CoarseToFine) return FindInliers_CoarseToFine(indices);
+
     while(true) {
       int sz = indices.size();
       {
@@ -741,6 +932,8 @@ namespace aam {
             indices = FindInliers(indices);
             break;
           }
+          default:
+            break;
         }
 
       }
@@ -751,120 +944,149 @@ namespace aam {
 
   std::vector<int> AAMModel::FindInliers_RPCA(vector<int> indices) {
     if(indices.empty()) {
-      indices.resize(input_images.size());
+      indices.resize(shapes.rows);
       std::iota(indices.begin(), indices.end(), 0);
     }
 
     const int nimages = indices.size();
 
-    set<int> current_set(indices.begin(), indices.end());
+    // Perform RPCA on the shapes, the texture model is built by ScoreSamples_RPCA
+    set<int> set_i(indices.begin(), indices.end());
+    Mat shapes_i(set_i.size(), shapes.cols, shapes.type());
+
+    int ridx = 0;
+    for(auto j : set_i) {
+      shapes_i.row(ridx) = shapes.row(j) * 1;
+      ++ridx;
+    }
+
+    {
+      boost::timer::auto_cpu_timer t("Matrix recovery finished in %w seconds.\n");
+      shapes_i = rpca<double>(shapes_i);
+    }
+
+    cv::PCA shape_model;
+    {
+      boost::timer::auto_cpu_timer t("Shape model constructed in %w seconds.\n");
+      shape_model = ComputePCA(shapes_i, 0.98, pca_options);
+    }
 
     vector<Mat> reconstructions(nimages), fitted_images(nimages);
-    Mat diffs(1, nimages, CV_64FC1);
+    Mat diffs = ScoreSamples_RPCA(indices, textures, normalized_textures, meantexture, metric,
+                                  reconstructions, fitted_images);
 
-    // Perform RPCA on both shapes and texture
-    set<int> set_i = current_set;
+    cv::Scalar mean_diff, stddev_diff;
+    cv::meanStdDev(diffs, mean_diff, stddev_diff);
+
+    cout << mean_diff << ", " << stddev_diff << endl;
+
+    // always create a new inlier directory
+    safe_create(fs::path(output_path) / fs::path("inliers"));
 
-    Mat shapes_i(set_i.size(), shapes.cols, shapes.type()),
-      normalized_textures_i(set_i.size(), normalized_textures.cols, normalized_textures.type());
+    set<int> res;
+    for(int i=0;i<nimages;++i) {
+      int max_idx = indices[i];
+
+      if(diffs.at<double>(0, i) >= mean_diff[0] + 2 * stddev_diff[0]) {
+        cout << "outlier: " << max_idx << endl;
+        DumpSample(max_idx, true, reconstructions[i], fitted_images[i]);
+      } else {
+        res.insert(indices[i]);
+        DumpSample(max_idx, false, reconstructions[i], fitted_images[i]);
+      }
+    }
+
+    cout << "done." << endl;
+
+    return vector<int>(res.begin(), res.end());
+  }
+
+  // Builds a texture model with RPCA from the rows indices of
+  // normalized_textures and scores each of these samples against it.
+  // textures and meantexture must belong to the same resolution, the fitting
+  // error is only defined at full resolution.
+  Mat AAMModel::ScoreSamples_RPCA(const vector<int>& indices,
+                                  const Mat& textures,
+                                  const Mat& normalized_textures,
+                                  const Mat& meantexture,
+                                  ErrorMetric metric,
+                                  vector<Mat>& reconstructions,
+                                  vector<Mat>& fitted_images,
+                                  const vector<int>& extra) const {
+    vector<int> scored = indices;
+    scored.insert(scored.end(), extra.begin(), extra.end());
+    const int nimages = scored.size();
+    reconstructions.resize(nimages);
+    fitted_images.resize(nimages);
+    Mat diffs(1, nimages, CV_64FC1);
+
+    set<int> set_i(indices.begin(), indices.end());
+    Mat normalized_textures_i(set_i.size(), normalized_textures.cols, normalized_textures.type());
 
     int ridx = 0;
     for(auto j : set_i) {
-      shapes_i.row(ridx) = shapes.row(j) * 1;
       normalized_textures_i.row(ridx) = normalized_textures.row(j) * 1;
       ++ridx;
     }
     Mat normalized_textures_i_reshaped = normalized_textures_i.reshape(1);
 
-    auto rpca = [](const cv::Mat& M){
-      Eigen::MatrixXd D, A, E;
-      D = CVMat2EigenMatrix<double>(M);
-      #if 1
-      Eigen::MatrixXd DT = D.transpose();
-      sp::ml::robust_pca(DT, A, E);
-      Eigen::MatrixXd AT = A.transpose();
-      return EigenMatrix2CVMat(AT);
-      #else
-      sp::ml::robust_pca(D, A, E);
-      return EigenMatrix2CVMat(A);
-      #endif
-    };
-
     {
       boost::timer::auto_cpu_timer t("Matrix recovery finished in %w seconds.\n");
-      shapes_i = rpca(shapes_i);
-      normalized_textures_i_reshaped = rpca(normalized_textures_i_reshaped);
+      normalized_textures_i_reshaped = rpca<TexelScalar>(normalized_textures_i_reshaped);
     }
 
-    // Construct shape and texture model with the provided indices
-    cv::PCA shape_model, texture_model;
-    {
-      boost::timer::auto_cpu_timer t("Shape model constructed in %w seconds.\n");
-      shape_model = shape_model(shapes_i, Mat(), CV_PCA_DATA_AS_ROW, 0.98);
-    }
+    // Construct the texture model with the provided indices
+    cv::PCA texture_model;
     {
       boost::timer::auto_cpu_timer t("Texture model constructed in %w seconds.\n");
-      texture_model = texture_model(normalized_textures_i_reshaped,
-                                    Mat(),
-                                    CV_PCA_DATA_AS_ROW,
-                                    0.98);
+      texture_model = ComputePCA(normalized_textures_i_reshaped, 0.98, pca_options);
     }
 
     PrintShape(texture_model.eigenvectors);
 
-    Mat coeffs(1, texture_model.mean.cols, texture_model.mean.type()), reconstructed;
-
-    //#pragma omp parallel for
-    for(int i=0;i<indices.size();++i) {
-      Mat vec = textures.row(indices[i]);
-
-      // normalize it
-      Mat normalized_vec, beta_i;
-      double alpha_i;
-      tie(normalized_vec, alpha_i, beta_i) = NormalizeTextureVec(vec, meantexture);
-      // subtract meantexture since the PCA model is built on difference
-      normalized_vec -= meantexture;
+    // Normalize the samples and project them all at once
+    vector<double> alphas;
+    vector<cv::Vec3d> betas;
+    Mat normalized = NormalizeSamples(scored, textures, meantexture, alphas, betas);
 
-      texture_model.project(normalized_vec.reshape(1), coeffs);
-      texture_model.backProject(coeffs, reconstructed);
-      reconstructed = reconstructed.reshape(3);
+    Mat reconstructed;
+    Mat residuals = ProjectRows(texture_model, normalized.reshape(1), &reconstructed, nullptr, nthreads);
 
+    PerThread<Mat> frames;
+    ParallelFor(nimages, [&](int i) {
       // unnormalize it
-      reconstructions[i] = (reconstructed + meantexture) * alpha_i + beta_i.reshape(3, 1);
+      reconstructions[i] = reconstructed.row(i).reshape(3) + meantexture;
+      DenormalizeTextureVec<TexelScalar>(reconstructions[i], alphas[i], betas[i]);
 
-      Mat fitted, warp_back;
       switch(metric) {
         case TextureError: {
-          diffs.at<double>(0, i) = cv::norm(normalized_vec, reconstructed, cv::NORM_L2);
+          diffs.at<double>(0, i) = residuals.at<double>(0, i);
           break;
         }
         case FittingError: {
-          // Warp reconstructed back to image space and compute fitting error using the pixel mask
-          double diff_i = 0;
-          cout << "warping image ..." << endl;
-          fitted = Mat(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-          FillImage(reconstructions[i], pixel_coords, fitted);
-          warp_back = WarpImage(fitted, tforms[indices[i]], inv_pixel_mats[indices[i]], inv_pixel_coords[indices[i]]);
+          Mat warp_back;
+          diffs.at<double>(0, i) = ComputeFittingError(scored[i], reconstructions[i], warp_back, &frames.local());
           fitted_images[i] = warp_back;
-          diffs.at<double>(0, i) = ComputeRMSE(warp_back, images[indices[i]], inv_pixel_coords[indices[i]]);
           break;
         }
         default:
           break;
       }
+    }, nthreads);
 
+    for(int i=0;i<nimages;++i) {
       printf("%d. diff = %g\n", i, diffs.at<double>(0, i));
 
     #if 0
-      cv::imshow("fitted", fitted);
+      Mat warp_back = fitted_images[i].clone();
 
-      cv::Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-      FillImage(textures.row(indices[i]), pixel_coords, img_ref);
+      cv::Mat img_ref(frame_size, texel_type, cv::Scalar(0, 0, 0));
+      FillImage<TexelScalar>(textures.row(scored[i]), texel_index, img_ref);
       cv::imshow("ref", img_ref);
 
-      Mat image_i = images[indices[i]].clone();
-      DrawShape(image_i, shapes.row(indices[i]));
-      cv::imshow("input", images[indices[i]]);
+      Mat image_i = GetTexelImage(scored[i]);
+      DrawShape(image_i, shapes.row(scored[i]));
+      cv::imshow("input", image_i);
 
       cv::putText(warp_back, std::to_string(diffs.at<double>(0, i)), cv::Point(5, 20),
                   cv::FONT_HERSHEY_SIMPLEX, 0.35, cv::Scalar(255, 175, 175));
@@ -874,57 +1096,164 @@ namespace aam {
     #endif
     }
 
-    cv::Scalar mean_diff, stddev_diff;
-    cv::meanStdDev(diffs, mean_diff, stddev_diff);
+    return diffs;
+  }
 
-    cout << mean_diff << ", " << stddev_diff << endl;
+  void AAMModel::BuildCoarseLevel() {
+    boost::timer::auto_cpu_timer t("Coarse texture level built in %w seconds.\n");
 
-    // always create a new inlier directory
-    safe_create(fs::path(output_path) / fs::path("inliers"));
+    const int nimages = textures.rows;
+    coarse_level.factor = 1 << pyramid_levels;
 
-    set<int> res;
-    for(int i=0;i<nimages;++i) {
-      int max_idx = indices[i];
+    // Frame sizes down the pyramid, pyrDown rounds odd sizes up
+    vector<cv::Size> sizes(1, frame_size);
+    for(int l=0;l<pyramid_levels;++l) {
+      sizes.push_back(cv::Size((sizes.back().width + 1) / 2, (sizes.back().height + 1) / 2));
+    }
+    coarse_level.frame_size = sizes.back();
+
+    // Pixel p of the coarse frame is centered on pixel p * factor of the
+    // texture space, so the coarse mesh is the mean shape scaled down
+    vector<cv::Point2f> verts = CVMat2Points(meanshape);
+    for(auto& v : verts) v *= 1.0f / coarse_level.factor;
+    coarse_level.texel_index.Build(verts, triangles, coarse_level.frame_size);
+
+    // Coverage of the texture space, the filtered textures are divided by it
+    // so the zeros outside the mesh do not darken the texels on its boundary
+    Mat mask(frame_size, CV_MAKETYPE(cv::DataType<TexelScalar>::depth, 1), cv::Scalar(0));
+    for(int k=0;k<texel_index.size();++k) {
+      mask.at<TexelScalar>(texel_index.rows[k], texel_index.cols[k]) = 1;
+    }
+    for(int l=1;l<=pyramid_levels;++l) {
+      Mat down;
+      cv::pyrDown(mask, down, sizes[l]);
+      mask = down;
+    }
 
-      if(diffs.at<double>(0, i) >= mean_diff[0] + 2 * stddev_diff[0]) {
-        cout << "outlier: " << max_idx << endl;
-        Mat img_i = images[max_idx].clone();
-        DrawShape(img_i, shapes.row(max_idx));
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + ".jpg", img_i * 255);
+    const TexelIndex& index = coarse_level.texel_index;
+    coarse_level.textures = Mat(nimages, index.size(), texel_type);
+
+    // The coarse textures are filtered from the full resolution ones, so no
+    // image has to be loaded or warped again
+    // Each thread keeps its own pyramid. Level 0 is only ever written at the
+    // texels of texel_index, the pixels outside the mesh stay zero.
+    PerThread<vector<Mat>> pyramids;
+    ParallelFor(nimages, [&](int i) {
+      vector<Mat>& pyramid = pyramids.local();
+      if(pyramid.empty()) {
+        pyramid.resize(pyramid_levels + 1);
+        pyramid[0] = Mat(frame_size, texel_type, cv::Scalar(0, 0, 0));
+      }
+
+      FillImage<TexelScalar>(textures.row(i), texel_index, pyramid[0]);
+      for(int l=1;l<=pyramid_levels;++l) {
+        // reuses the level allocated for the previous image
+        cv::pyrDown(pyramid[l-1], pyramid[l], sizes[l]);
+      }
+      const Mat& img = pyramid.back();
 
-        Mat img_fitted = fitted_images[i];
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + "_fitted.jpg", img_fitted * 255);
+      Texel* tex = coarse_level.textures.ptr<Texel>(i);
+      for(int k=0;k<index.size();++k) {
+        const int r = index.rows[k], c = index.cols[k];
+        const TexelScalar m = mask.at<TexelScalar>(r, c);
+        tex[k] = m > 0 ? img.at<Texel>(r, c) * (1 / m) : Texel(0, 0, 0);
+      }
+    }, nthreads);
 
-        Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(reconstructions[i], pixel_coords, img);
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + "_fitted_tex.jpg", img * 255);
+    coarse_level.meantexture = NormalizeTextures(coarse_level.textures, coarse_level.normalized_textures);
 
-        Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(textures.row(max_idx) + meantexture, pixel_coords, img_ref);
-        cv::imwrite(output_path + "/outliers/" + "image" + to_string(max_idx) + "_warped.jpg", img_ref * 255);
-      } else {
-        res.insert(indices[i]);
+    cout << "Coarse level: " << coarse_level.frame_size.width << "x" << coarse_level.frame_size.height << ", "
+         << index.size() << " texels instead of " << texel_index.size() << endl;
+  }
 
-        Mat img_i = images[max_idx].clone();
-        DrawShape(img_i, shapes.row(max_idx));
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + ".jpg", img_i * 255);
+  std::vector<int> AAMModel::FindInliers_CoarseToFine(vector<int> indices) {
+    if(indices.empty()) {
+      indices.resize(shapes.rows);
+      std::iota(indices.begin(), indices.end(), 0);
+    }
 
-        Mat img_fitted = fitted_images[i];
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + "_fitted.jpg", img_fitted * 255);
+    if(coarse_level.textures.empty()) BuildCoarseLevel();
 
-        Mat img(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(reconstructions[i], pixel_coords, img);
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + "_fitted_tex.jpg", img * 255);
+    // Same cut as FindInliers_RPCA, in standard deviations above the mean
+    const double outlier_zscore = 2.0;
 
-        Mat img_ref(images.front().rows, images.front().cols, images.front().type(), cv::Scalar(0, 0, 0));
-        FillImage(textures.row(max_idx) + meantexture, pixel_coords, img_ref);
-        cv::imwrite(output_path + "/inliers/" + "image" + to_string(max_idx) + "_warped.jpg", img_ref * 255);
+    // Run the outlier rounds on the coarse textures until the set is stable.
+    // Every sample keeps the z-score of the last round that scored it.
+    map<int, double> zscores;
+    vector<Mat> reconstructions, fitted_images;
+    while(true) {
+      boost::timer::auto_cpu_timer t("Coarse iteration finished in %w seconds.\n");
+      Mat diffs = ScoreSamples_RPCA(indices,
+                                    coarse_level.textures,
+                                    coarse_level.normalized_textures,
+                                    coarse_level.meantexture,
+                                    TextureError,
+                                    reconstructions, fitted_images);
+
+      cv::Scalar mean_diff, stddev_diff;
+      cv::meanStdDev(diffs, mean_diff, stddev_diff);
+      cout << mean_diff << ", " << stddev_diff << endl;
+
+      vector<int> inliers;
+      for(int i=0;i<indices.size();++i) {
+        const double z = stddev_diff[0] > 0 ? (diffs.at<double>(0, i) - mean_diff[0]) / stddev_diff[0] : 0;
+        zscores[indices[i]] = z;
+        if(z < outlier_zscore) inliers.push_back(indices[i]);
       }
+
+      if(inliers.size() == indices.size()) break;
+      indices = inliers;
+    }
+
+    // Samples within the band around the cut are borderline and get
+    // re-scored at full resolution, the coarse decision stands for the rest
+    set<int> borderline;
+    vector<int> candidates, coarse_outliers;
+    for(auto& p : zscores) {
+      const bool is_borderline = fabs(p.second - outlier_zscore) < borderline_band;
+      if(is_borderline) borderline.insert(p.first);
+      if(is_borderline || p.second < outlier_zscore) candidates.push_back(p.first);
+      else coarse_outliers.push_back(p.first);
+    }
+    cout << borderline.size() << " borderline samples." << endl;
+
+    // The cut is a statistic of the set, so the full resolution round scores
+    // all candidates but only flips the borderline ones. The set is the
+    // candidates, not the original population: the mean and deviation no
+    // longer include the coarse outliers. Those are only reconstructed
+    // against the candidates' model so they can be dumped too.
+    Mat diffs = ScoreSamples_RPCA(candidates, textures, normalized_textures, meantexture, metric,
+                                  reconstructions, fitted_images, coarse_outliers);
+
+    cv::Scalar mean_diff, stddev_diff;
+    cv::meanStdDev(diffs.colRange(0, candidates.size()), mean_diff, stddev_diff);
+
+    cout << mean_diff << ", " << stddev_diff << endl;
+
+    // always create a new inlier directory
+    safe_create(fs::path(output_path) / fs::path("inliers"));
+
+    vector<int> res;
+    for(int i=0;i<candidates.size();++i) {
+      const int idx = candidates[i];
+      const bool outlier = borderline.count(idx)
+                           ? diffs.at<double>(0, i) >= mean_diff[0] + outlier_zscore * stddev_diff[0]
+                           : false;
+
+      if(outlier) cout << "outlier: " << idx << endl;
+      else res.push_back(idx);
+      DumpSample(idx, outlier, reconstructions[i], fitted_images[i]);
+    }
+
+    for(int i=0;i<coarse_outliers.size();++i) {
+      const int k = candidates.size() + i;
+      cout << "outlier (coarse): " << coarse_outliers[i] << endl;
+      DumpSample(coarse_outliers[i], true, reconstructions[k], fitted_images[k]);
     }
 
     cout << "done." << endl;
 
-    return vector<int>(res.begin(), res.end());
+    return res;
   }
 
 }
@@ -1,8 +1,22 @@
 #pragma once
 
 #include "common.h"
+#include "imageprovider.h"
+#include "modelfile.h"
+#include "pca.h"
+#include "texelindex.h"
 
 namespace aam {
+  // Scalar type of the images and textures in the texture pipeline. Building
+  // with AAM_SINGLE_PRECISION halves their memory footprint.
+#ifdef AAM_SINGLE_PRECISION
+  typedef float TexelScalar;
+#else
+  typedef double TexelScalar;
+#endif
+  typedef cv::Vec<TexelScalar, 3> Texel;
+  const int texel_type = CV_MAKETYPE(cv::DataType<TexelScalar>::depth, 3);
+
   class AAMModel {
   public:
     enum ErrorMetric {
@@ -12,7 +26,8 @@ namespace aam {
 
     enum Method {
       LeaveOneOut,
-      RobustPCA
+      RobustPCA,
+      CoarseToFine   //!< RobustPCA rounds on a coarse level, see SetPyramidLevels
     };
   public:
     AAMModel();
@@ -20,22 +35,77 @@ namespace aam {
     ~AAMModel(){}
 
     void SetImages(const std::vector<QImage>& images);
+    void SetImageProvider(const std::shared_ptr<ImageProvider>& provider);
+    // Memory budget for the images kept resident in streaming mode
+    void SetImageBudget(size_t bytes) {
+      image_budget = bytes;
+    }
     void SetPoints(const std::vector<cv::Mat>& points);
+    // Worker threads for the per-image preprocessing stages, 0 uses all cores
+    void SetThreadCount(int n) {
+      nthreads = n;
+    }
     void SetOutputPath(const std::string& path);
+    // Directory for the texture space raster cache, empty disables it
+    void SetRasterCachePath(const std::string& path) {
+      raster_cache_path = path;
+    }
+    // Backend of the shape and texture models
+    void SetPCAOptions(const PCAOptions& options) {
+      pca_options = options;
+    }
     void SetErrorMetric(ErrorMetric m) {
       metric = m;
     }
+    // Keep the input images as 8-bit BGR instead of texel_type and sample
+    // them in fixed point, only the texture vectors are floating point. Must
+    // be set before Preprocess.
+    void SetKeep8BitImages(bool b) {
+      keep_8bit_images = b;
+    }
+    // Number of 2x downsamplings from the texture space to the coarse level
+    // used by the CoarseToFine outlier filter, 0 disables the coarse level.
+    // Samples within band standard deviations of the outlier cut on the
+    // coarse level are re-scored at full resolution, against the mean and
+    // standard deviation of the samples still in play there rather than of
+    // the whole input. Must be set before Preprocess.
+    void SetPyramidLevels(int levels, double band = 0.5) {
+      pyramid_levels = levels;
+      borderline_band = band;
+    }
+    // In streaming mode full-frame images are loaded and converted on demand
+    // through an LRU cache bounded by the image budget, only the texture rows
+    // are always resident. Must be set before Preprocess.
+    void SetStreaming(bool s) {
+      streaming = s;
+    }
 
     void Preprocess();
     void ProcessImages();
     void ProcessShapes();
     void InitializeMeanShapeAndTexture();
 
+    // Builds the shape and texture models, SaveModel writes them out
     void BuildModel(std::vector<int> indices = std::vector<int>());
+    // Returns false if the file cannot be written
+    bool SaveModel(const std::string& filename) const;
+    // Maps a model saved by SaveModel in place of Preprocess and BuildModel,
+    // the model matrices share memory with the file. Returns false if it
+    // cannot be loaded.
+    bool LoadModel(const std::string& filename);
+    // Residual norms of images under the texture model, as a 1 x n
+    // CV_64FC1 Mat, after LoadModel or BuildModel. Image i (8-bit BGR or
+    // texel_type) is warped into the mean shape through points[i], its
+    // landmarks as npoints x 2 or 1 x 2*npoints CV_64FC1, then normalized
+    // and projected like the samples of BuildModel. Needs no Preprocess.
+    cv::Mat ScoreImages(const std::vector<cv::Mat>& images,
+                        const std::vector<cv::Mat>& points) const;
+
     std::vector<int> FindInliers_Iterative(std::vector<int> indices = std::vector<int>(), Method method = RobustPCA);
 
     std::vector<int> FindInliers(std::vector<int> indices = std::vector<int>());
     std::vector<int> FindInliers_RPCA(std::vector<int> indices = std::vector<int>());
+    std::vector<int> FindInliers_CoarseToFine(std::vector<int> indices = std::vector<int>());
 
   protected:
     void Init();
@@ -45,42 +115,89 @@ namespace aam {
                        const cv::Mat& to_shape);
     cv::Mat ScaleShape(const cv::Mat& shape, double size);
 
-    cv::Mat ComputeMeanTexture(const std::vector<cv::Mat>& images,
-                               const cv::Mat& shapes,
+    cv::Mat ComputeMeanTexture(const cv::Mat& shapes,
                                const cv::Mat& meanshape);
+    cv::Mat NormalizeTextures(const cv::Mat& textures, cv::Mat& normalized_textures) const;
+    cv::Mat NormalizeSamples(const std::vector<int>& indices,
+                             const cv::Mat& textures,
+                             const cv::Mat& meantexture,
+                             std::vector<double>& alphas,
+                             std::vector<cv::Vec3d>& betas) const;
+    void BuildCoarseLevel();
+
+    cv::Mat GetImage(int i) const;
+    cv::Mat GetTexelImage(int i) const;
+    void ComputeInversePixelInfo(int i, TexelIndex& index) const;
+    uint64_t RasterCacheKey(const cv::Mat& meanshape) const;
+    std::string RasterCacheFilename(uint64_t key) const;
+    bool LoadRasterCache(uint64_t key);
+    void SaveRasterCache(uint64_t key) const;
+
+    // frame, if given, is a scratch image of the texture space kept between
+    // calls, e.g. one per thread, so the reconstruction is not filled into a
+    // new image every time
+    double ComputeFittingError(int i, const cv::Mat& reconstruction, cv::Mat& warp_back,
+                               cv::Mat* frame = nullptr) const;
+    // Scores the samples of indices against a robust model built from them.
+    // The samples of extra are scored against the same model without
+    // contributing to it, their results follow those of indices.
+    cv::Mat ScoreSamples_RPCA(const std::vector<int>& indices,
+                              const cv::Mat& textures,
+                              const cv::Mat& normalized_textures,
+                              const cv::Mat& meantexture,
+                              ErrorMetric metric,
+                              std::vector<cv::Mat>& reconstructions,
+                              std::vector<cv::Mat>& fitted_images,
+                              const std::vector<int>& extra = std::vector<int>()) const;
+    void DumpSample(int idx, bool outlier, const cv::Mat& reconstruction, const cv::Mat& fitted) const;
 
   private:
+    // Textures of all samples at a coarser resolution than the texture space
+    struct TextureLevel {
+      int factor;             //!< downsampling factor from the texture space
+      cv::Size frame_size;
+      TexelIndex texel_index;
+      cv::Mat textures, normalized_textures, meantexture;
+    };
+
     // Input data
-    std::vector<QImage> input_images;
+    std::shared_ptr<ImageProvider> image_provider;
     std::vector<cv::Mat> input_points;
 
     // Output related
     std::string output_path;
-
-    // Converted data
-    std::vector<cv::Mat> images, warped_images;
+    std::string raster_cache_path;
+
+    // Converted data, empty in streaming mode. The images are CV_8UC3 when
+    // keep_8bit_images is set and texel_type otherwise.
+    std::vector<cv::Mat> images;
+    std::unique_ptr<ImageCache> image_cache;  //!< converted images in streaming mode
+    size_t image_budget;
+    int nthreads;
+    cv::Size frame_size;  //!< size of the input images and the texture space
     cv::Mat shapes;
     cv::Mat textures, normalized_textures;
 
     std::vector<cv::Vec3i> triangles; //!< triangulation of the shapes
 
     // Affine transformation from each triangle to the meanshape in each image
-    std::vector<std::vector<cv::Mat>> tforms, tforms_inv;
+    std::vector<std::vector<cv::Mat>> tforms;
 
-    const int tri_id_offset = 128;
-    cv::Mat pixel_map;  //!< pixel to triangle indices map in the texture space
-    std::vector<cv::Mat> inv_pixel_maps;  //!< pixel to triangle indices map in the input image space
+    TexelIndex texel_index;  //!< texels of each triangle in the texture space
+    std::vector<TexelIndex> inv_texel_indices;  //!< texels of each triangle in the input image space
 
-    std::vector<int> pixel_counts;  //!< pixel counts in texture space
-    std::vector<std::vector<int>> inv_pixel_counts; //!< pixel counts in image space
+    cv::Mat meanshape, meantexture;
 
-    std::vector<std::vector<cv::Vec2i>> pixel_coords;
-    std::vector<std::vector<std::vector<cv::Vec2i>>> inv_pixel_coords;
-    std::vector<cv::Mat> pixel_mats;
-    std::vector<std::vector<cv::Mat>> inv_pixel_mats, inv_pixel_pts;
+    cv::PCA shape_model, texture_model;
+    std::shared_ptr<ModelFile> model_file;  //!< keeps a loaded model mapped
 
-    cv::Mat meanshape, meantexture;
+    TextureLevel coarse_level;
+    int pyramid_levels;
+    double borderline_band;
 
     ErrorMetric metric;
+    PCAOptions pca_options;
+    bool streaming;
+    bool keep_8bit_images;
   };
 }
@@ -2,6 +2,7 @@
 
 // STL stuff
 #include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <fstream>
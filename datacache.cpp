@@ -0,0 +1,189 @@
+#include "datacache.h"
+#include "utils.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace aam {
+  namespace fs = boost::filesystem;
+
+  namespace {
+    const char pack_magic[8] = {'A', 'A', 'M', 'P', 'A', 'C', 'K', '\0'};
+    const uint32_t pack_version = 1;
+    const size_t pack_alignment = 64;
+
+    // Whether the blocks of entry e lie inside a file of file_size bytes.
+    // Images are RGB888 with scanlines padded to 4 bytes, as packed by
+    // PackDataset.
+    bool entry_in_bounds(const PackedDataset::PackEntry& e, uint64_t file_size) {
+      if(e.width <= 0 || e.height <= 0 || e.npoints < 0) return false;
+      if(e.bytes_per_line < int64_t(e.width) * 3 || e.bytes_per_line % 4 != 0) return false;
+
+      const uint64_t image_bytes = uint64_t(e.bytes_per_line) * e.height;
+      const uint64_t points_bytes = uint64_t(e.npoints) * 2 * sizeof(double);
+      return e.image_offset <= file_size && image_bytes <= file_size - e.image_offset &&
+             e.points_offset % sizeof(double) == 0 &&
+             e.points_offset <= file_size && points_bytes <= file_size - e.points_offset;
+    }
+
+    uint64_t hash_file_stats(const string& filename, uint64_t h) {
+      h = HashBytes(filename.data(), filename.size(), h);
+
+      boost::system::error_code ec;
+      int64_t stats[2] = {-1, -1};
+      uintmax_t sz = fs::file_size(filename, ec);
+      if(!ec) stats[0] = sz;
+      time_t mtime = fs::last_write_time(filename, ec);
+      if(!ec) stats[1] = mtime;
+      return HashBytes(stats, sizeof(stats), h);
+    }
+  }
+
+  bool PackedDataset::Open(const string& filename, uint64_t key) {
+    header = nullptr;
+    index = nullptr;
+
+    if(!file.Open(filename)) return false;
+    if(file.size() < sizeof(PackHeader)) return false;
+
+    const PackHeader* h = reinterpret_cast<const PackHeader*>(file.data());
+    if(memcmp(h->magic, pack_magic, sizeof(pack_magic)) != 0) return false;
+    if(h->version != pack_version || h->key != key) return false;
+    if(h->index_offset % sizeof(uint64_t) != 0 || h->index_offset > file.size() ||
+       uint64_t(h->nentries) * sizeof(PackEntry) > file.size() - h->index_offset) return false;
+
+    // Images are wrapped in place, so a truncated or foreign pack must be
+    // caught here rather than read past the mapping later
+    const PackEntry* entries = reinterpret_cast<const PackEntry*>(file.data() + h->index_offset);
+    for(uint32_t i=0;i<h->nentries;++i) {
+      if(!entry_in_bounds(entries[i], file.size())) return false;
+    }
+
+    header = h;
+    index = entries;
+    return true;
+  }
+
+  QImage PackedDataset::Image(int i) const {
+    const PackEntry& e = index[i];
+    return QImage(reinterpret_cast<const uchar*>(file.data() + e.image_offset),
+                  e.width, e.height, e.bytes_per_line, QImage::Format_RGB888);
+  }
+
+  cv::Mat PackedDataset::Points(int i) const {
+    const PackEntry& e = index[i];
+    const double* p = reinterpret_cast<const double*>(file.data() + e.points_offset);
+    // points are tiny, copy them so callers are free to modify them
+    return cv::Mat(e.npoints, 2, CV_64FC1, const_cast<double*>(p)).clone();
+  }
+
+  vector<QImage> PackedDataset::Images() const {
+    vector<QImage> images(size());
+    for(int i=0;i<size();++i) images[i] = Image(i);
+    return images;
+  }
+
+  vector<cv::Mat> PackedDataset::Points() const {
+    vector<cv::Mat> points(size());
+    for(int i=0;i<size();++i) points[i] = Points(i);
+    return points;
+  }
+
+  uint64_t ComputeDatasetKey(const string& settings_filename,
+                             const vector<pair<string, string>>& image_points_filenames) {
+    MappedFile settings(settings_filename);
+    uint64_t h = HashBytes(settings.data(), settings.size());
+    for(auto& p : image_points_filenames) {
+      h = hash_file_stats(p.first, h);
+      h = hash_file_stats(p.second, h);
+    }
+    return h;
+  }
+
+  void PackDataset(const vector<pair<string, string>>& image_points_filenames,
+                   uint64_t key,
+                   const string& cache_filename,
+                   const LoaderOptions& options) {
+    PackedDataset::PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, pack_magic, sizeof(pack_magic));
+    header.version = pack_version;
+    header.key = key;
+
+    AtomicWriteFile(cache_filename, [&](ofstream& fout) {
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      uint64_t offset = sizeof(header);
+
+      // An entry that cannot be loaded is left out. Packing it empty would
+      // make Open reject the whole file, and the same file would be repacked
+      // and rejected on every later run.
+      vector<PackedDataset::PackEntry> index;
+      index.reserve(image_points_filenames.size());
+      ForEachImagePointsPair(image_points_filenames,
+                             [&](int i, QImage& img, cv::Mat& pts) {
+                               if(img.isNull() || pts.rows == 0) {
+                                 cerr << "Failed to load " << image_points_filenames[i].first << " or "
+                                      << image_points_filenames[i].second << ", left out of the pack" << endl;
+                                 return;
+                               }
+
+                               QImage rgb = img.convertToFormat(QImage::Format_RGB888);
+                               index.push_back(PackedDataset::PackEntry());
+                               PackedDataset::PackEntry& e = index.back();
+                               e.width = rgb.width();
+                               e.height = rgb.height();
+                               e.bytes_per_line = rgb.bytesPerLine();
+                               e.npoints = pts.rows;
+
+                               WritePadding(fout, offset, pack_alignment);
+                               e.image_offset = offset;
+                               const uint64_t image_bytes = uint64_t(e.bytes_per_line) * e.height;
+                               fout.write(reinterpret_cast<const char*>(rgb.constBits()), image_bytes);
+                               offset += image_bytes;
+
+                               WritePadding(fout, offset, pack_alignment);
+                               e.points_offset = offset;
+                               cv::Mat p = pts.isContinuous() ? pts : pts.clone();
+                               fout.write(reinterpret_cast<const char*>(p.data), pts.rows * 2 * sizeof(double));
+                               offset += pts.rows * 2 * sizeof(double);
+                             },
+                             options);
+
+      WritePadding(fout, offset, pack_alignment);
+      header.index_offset = offset;
+      header.nentries = index.size();
+      fout.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(index[0]));
+
+      fout.seekp(0);
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    });
+  }
+
+  shared_ptr<PackedDataset> OpenPackedDataset(
+    const string& settings_filename,
+    const vector<pair<string, string>>& image_points_filenames,
+    const string& cache_filename,
+    const LoaderOptions& options
+  ) {
+    const uint64_t key = ComputeDatasetKey(settings_filename, image_points_filenames);
+
+    shared_ptr<PackedDataset> dataset = make_shared<PackedDataset>();
+    if(dataset->Open(cache_filename, key)) {
+      cout << "Using packed dataset " << cache_filename << endl;
+      return dataset;
+    }
+
+    {
+      boost::timer::auto_cpu_timer t("Dataset packed in %w seconds.\n");
+      cout << "Packing dataset into " << cache_filename << " ..." << endl;
+      PackDataset(image_points_filenames, key, cache_filename, options);
+    }
+
+    if(!dataset->Open(cache_filename, key)) {
+      cerr << "Failed to open packed dataset " << cache_filename << endl;
+      return nullptr;
+    }
+    return dataset;
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+#include "ioutils.h"
+
+#include <memory>
+
+namespace aam {
+
+  // Read-only view of a packed dataset file. The file holds every image of a
+  // settings file decoded to 8-bit RGB plus its 0-based landmarks, behind an
+  // index header, with each image aligned to a 64-byte boundary:
+  //
+  //   PackHeader | image 0 | points 0 | image 1 | points 1 | ... | PackEntry[n]
+  //
+  // The file is mmapped, so only the images that are actually touched are
+  // paged in.
+  class PackedDataset {
+  public:
+    struct PackHeader {
+      char magic[8];          //!< "AAMPACK\0"
+      uint32_t version;
+      uint32_t nentries;
+      uint64_t key;           //!< ComputeDatasetKey of the packed dataset
+      uint64_t index_offset;  //!< file offset of the PackEntry table
+    };
+
+    struct PackEntry {
+      uint64_t image_offset;  //!< RGB888 scanlines, bytes_per_line apart
+      uint64_t points_offset; //!< npoints x 2 doubles
+      int32_t width, height, bytes_per_line, npoints;
+    };
+
+    // Maps filename and checks that it was packed from a dataset with the
+    // given key. Returns false if the file is missing, corrupt or stale.
+    bool Open(const std::string& filename, uint64_t key);
+
+    int size() const { return header == nullptr ? 0 : header->nentries; }
+
+    // The image shares memory with the mapping and must not outlive it
+    QImage Image(int i) const;
+    cv::Size ImageSize(int i) const { return cv::Size(index[i].width, index[i].height); }
+    cv::Mat Points(int i) const;
+
+    std::vector<QImage> Images() const;
+    std::vector<cv::Mat> Points() const;
+
+  private:
+    MappedFile file;
+    const PackHeader* header = nullptr;
+    const PackEntry* index = nullptr;
+  };
+
+  // Identifies a dataset by the content of its settings file and the size
+  // and modification time of every image and points file it lists.
+  uint64_t ComputeDatasetKey(
+    const std::string& settings_filename,
+    const std::vector<std::pair<std::string, std::string>>& image_points_filenames);
+
+  // Decodes all images and points and writes them to a packed dataset file.
+  // Entries whose image or points cannot be loaded are reported and left out.
+  void PackDataset(
+    const std::vector<std::pair<std::string, std::string>>& image_points_filenames,
+    uint64_t key,
+    const std::string& cache_filename,
+    const LoaderOptions& options = LoaderOptions());
+
+  // Opens cache_filename, packing the dataset into it first if it does not
+  // exist yet or was built from a different version of the dataset.
+  std::shared_ptr<PackedDataset> OpenPackedDataset(
+    const std::string& settings_filename,
+    const std::vector<std::pair<std::string, std::string>>& image_points_filenames,
+    const std::string& cache_filename,
+    const LoaderOptions& options = LoaderOptions());
+}
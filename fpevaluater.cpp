@@ -174,7 +174,7 @@ void FeaturePointsEvaluater::Evaluate() const {
     for(int i=0;i<npoints;++i) {
       cout << "patch " << i << endl;
       // construct PCA model
-      patch_models[i] = patch_models[i](patches_db[i], Mat(), CV_PCA_DATA_AS_ROW, 0.5);
+      patch_models[i] = ComputePCA(patches_db[i], 0.5, pca_options);
 
       // reconstruct patch
       for(int j=0;j<nimages;++j) {
@@ -245,7 +245,7 @@ void FeaturePointsEvaluater::Evaluate() const {
       }
 
       // construct PCA model
-      patch_models[i] = patch_models[i](patches_db[i], Mat(), CV_PCA_DATA_AS_ROW, 0.75);
+      patch_models[i] = ComputePCA(patches_db[i], 0.75, pca_options);
     }
 
     // reconstruct patches
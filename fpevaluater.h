@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "pca.h"
 
 using std::vector;
 using std::string;
@@ -16,6 +17,10 @@ namespace aam {
     void SetOutputPath(const string& p) {
       output_path = p;
     }
+    // Backend of the per-landmark patch models
+    void SetPCAOptions(const PCAOptions& options) {
+      pca_options = options;
+    }
     void Evaluate() const;
 
   protected:
@@ -29,6 +34,7 @@ namespace aam {
     vector<cv::Mat> input_points;
 
     string output_path;
+    PCAOptions pca_options;
   };
 
 }
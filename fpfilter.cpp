@@ -1,5 +1,6 @@
 #include "common.h"
 #include "ioutils.h"
+#include "datacache.h"
 #include "fpevaluater.h"
 #include "utils.h"
 
@@ -16,7 +17,13 @@ int main(int argc, char** argv) {
   desc.add_options()
     ("settings_file", po::value<string>()->required(), "Input settings file")
     ("output_path", po::value<string>()->default_value("."), "Output folder")
-    ("mode", po::value<string>()->default_value("filter"), "Mode to run");
+    ("mode", po::value<string>()->default_value("filter"), "Mode to run")
+    ("threads", po::value<int>()->default_value(0), "Number of image loading threads, 0 uses all cores")
+    ("max_inflight_mb", po::value<int>()->default_value(1024), "Cap on decoded image data waiting to be consumed, in MB")
+    ("pca_backend", po::value<string>()->default_value("exact"), "Decomposition for the PCA models: exact or randomized")
+    ("pca_seed", po::value<uint64_t>()->default_value(0), "Seed of the randomized PCA backend")
+    ("pca_tolerance", po::value<double>()->default_value(1e-4), "Randomized PCA stops growing the rank once a block adds less than this fraction of the variance")
+    ("pack_cache", po::value<string>()->default_value(""), "Packed dataset file to load images from, rebuilt when the dataset changes");
 
   po::variables_map vm;
 
@@ -36,6 +43,12 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  const string pca_backend = vm["pca_backend"].as<string>();
+  if(pca_backend != "exact" && pca_backend != "randomized") {
+    cerr << "Error: unknown PCA backend " << pca_backend << ", expected exact or randomized" << endl;
+    return 1;
+  }
+
   const string settings_filename(vm["settings_file"].as<string>());
 
   // Parse the setting file and load image related resources
@@ -43,21 +56,41 @@ int main(int argc, char** argv) {
 
   vector<pair<string, string>> image_points_filenames = ParseSettingsFile(settings_filename);
 
-  int nentries = image_points_filenames.size();
-  vector<QImage> images(nentries);
-  vector<cv::Mat> points(nentries);
-
-  for(auto& p : enumerate(image_points_filenames)) {
-    fs::path image_filename = settings_filepath.parent_path() / fs::path(p.second.first);
-    fs::path pts_filename = settings_filepath.parent_path() / fs::path(p.second.second);
-    cout << "[" << image_filename << ", " << pts_filename << "]" << endl;
+  for(auto& p : image_points_filenames) {
+    p.first = (settings_filepath.parent_path() / fs::path(p.first)).string();
+    p.second = (settings_filepath.parent_path() / fs::path(p.second)).string();
+  }
 
-    int i = p.first;
-    tie(images[i], points[i]) = LoadImagePointsPair(image_filename.string(), pts_filename.string());
+  LoaderOptions loader_options;
+  loader_options.nthreads = vm["threads"].as<int>();
+  loader_options.max_inflight_bytes = static_cast<size_t>(vm["max_inflight_mb"].as<int>()) << 20;
+
+  vector<QImage> images;
+  vector<cv::Mat> points;
+
+  // The images share memory with the packed dataset, keep it mapped until exit
+  shared_ptr<PackedDataset> dataset;
+  const string pack_cache = vm["pack_cache"].as<string>();
+  if(!pack_cache.empty()) {
+    dataset = OpenPackedDataset(settings_filename, image_points_filenames, pack_cache, loader_options);
+    if(!dataset) return 1;
+    images = dataset->Images();
+    points = dataset->Points();
+  } else {
+    boost::timer::auto_cpu_timer t("Loaded images and points in %w seconds.\n");
+    tie(images, points) = LoadImagePointsPairs(image_points_filenames, loader_options);
   }
+  cout << images.size() << " images loaded." << endl;
+
+  PCAOptions pca_options;
+  pca_options.backend = pca_backend == "randomized" ? PCAOptions::Randomized : PCAOptions::Exact;
+  pca_options.seed = vm["pca_seed"].as<uint64_t>();
+  pca_options.tolerance = vm["pca_tolerance"].as<double>();
+  pca_options.nthreads = vm["threads"].as<int>();
 
   FeaturePointsEvaluater eval(images, points);
   eval.SetOutputPath(vm["output_path"].as<string>());
+  eval.SetPCAOptions(pca_options);
   eval.Evaluate();
 
   return 0;
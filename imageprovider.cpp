@@ -0,0 +1,75 @@
+#include "imageprovider.h"
+#include "datacache.h"
+
+#include <QImageReader>
+
+using namespace std;
+
+namespace aam {
+  cv::Size FileImageProvider::ImageSize(int i) const {
+    QSize sz = QImageReader(QString(filenames[i].c_str())).size();
+    if(!sz.isValid()) return ImageProvider::ImageSize(i);
+    return cv::Size(sz.width(), sz.height());
+  }
+
+  int PackedImageProvider::size() const {
+    return dataset->size();
+  }
+
+  QImage PackedImageProvider::Load(int i) const {
+    return dataset->Image(i);
+  }
+
+  cv::Size PackedImageProvider::ImageSize(int i) const {
+    return dataset->ImageSize(i);
+  }
+
+  ImageCache::ImageCache(const shared_ptr<ImageProvider>& provider,
+                         Converter convert,
+                         size_t budget_bytes)
+    : provider(provider), convert(convert), budget(budget_bytes), bytes(0) {}
+
+  size_t ImageCache::resident_bytes() const {
+    lock_guard<mutex> lock(mtx);
+    return bytes;
+  }
+
+  cv::Mat ImageCache::Get(int i) {
+    {
+      lock_guard<mutex> lock(mtx);
+      auto it = entries.find(i);
+      if(it != entries.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+      }
+    }
+
+    // Load and convert without holding the lock so other threads can hit
+    // the cache in the meantime
+    cv::Mat img = convert(provider->Load(i));
+    const size_t img_bytes = img.total() * img.elemSize();
+
+    lock_guard<mutex> lock(mtx);
+    auto it = entries.find(i);
+    if(it != entries.end()) {
+      // another thread loaded it first
+      lru.splice(lru.begin(), lru, it->second);
+      return it->second->second;
+    }
+
+    lru.push_front(make_pair(i, img));
+    entries[i] = lru.begin();
+    bytes += img_bytes;
+
+    // Evict least recently used images, returned Mats stay valid since they
+    // share ownership of the pixel data
+    while(bytes > budget && lru.size() > 1) {
+      const cv::Mat& victim = lru.back().second;
+      bytes -= victim.total() * victim.elemSize();
+      entries.erase(lru.back().first);
+      lru.pop_back();
+    }
+
+    return img;
+  }
+}
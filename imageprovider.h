@@ -0,0 +1,95 @@
+#pragma once
+
+#include "common.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+
+namespace aam {
+  class PackedDataset;
+
+  // Source of the input images of a model. Images are loaded on request, so
+  // providers backed by files or a packed dataset do not need to keep them
+  // in memory.
+  class ImageProvider {
+  public:
+    virtual ~ImageProvider() {}
+
+    virtual int size() const = 0;
+    virtual QImage Load(int i) const = 0;
+    // Size of image i. Providers override it when the size is known without
+    // decoding the image.
+    virtual cv::Size ImageSize(int i) const {
+      QImage img = Load(i);
+      return cv::Size(img.width(), img.height());
+    }
+  };
+
+  class InMemoryImageProvider : public ImageProvider {
+  public:
+    explicit InMemoryImageProvider(const std::vector<QImage>& images) : images(images) {}
+
+    int size() const { return images.size(); }
+    QImage Load(int i) const { return images[i]; }
+    cv::Size ImageSize(int i) const { return cv::Size(images[i].width(), images[i].height()); }
+
+  private:
+    std::vector<QImage> images;
+  };
+
+  // Decodes the image file again on every Load
+  class FileImageProvider : public ImageProvider {
+  public:
+    explicit FileImageProvider(const std::vector<std::string>& filenames) : filenames(filenames) {}
+
+    int size() const { return filenames.size(); }
+    QImage Load(int i) const { return QImage(filenames[i].c_str()); }
+    // Reads the image header only
+    cv::Size ImageSize(int i) const;
+
+  private:
+    std::vector<std::string> filenames;
+  };
+
+  // Wraps the mmapped images of a packed dataset, nothing is decoded
+  class PackedImageProvider : public ImageProvider {
+  public:
+    explicit PackedImageProvider(const std::shared_ptr<PackedDataset>& dataset) : dataset(dataset) {}
+
+    int size() const;
+    QImage Load(int i) const;
+    cv::Size ImageSize(int i) const;
+
+  private:
+    std::shared_ptr<PackedDataset> dataset;
+  };
+
+  // Converted images of a provider, kept resident up to a memory budget.
+  // When the budget is exceeded the least recently used images are evicted
+  // and reloaded from the provider on the next access. Get is thread safe.
+  class ImageCache {
+  public:
+    typedef std::function<cv::Mat(const QImage&)> Converter;
+
+    ImageCache(const std::shared_ptr<ImageProvider>& provider,
+               Converter convert,
+               size_t budget_bytes);
+
+    cv::Mat Get(int i);
+
+    size_t resident_bytes() const;
+
+  private:
+    typedef std::list<std::pair<int, cv::Mat>> LRUList;
+
+    std::shared_ptr<ImageProvider> provider;
+    Converter convert;
+    size_t budget;
+
+    mutable std::mutex mtx;
+    LRUList lru;  //!< most recently used image first
+    std::unordered_map<int, LRUList::iterator> entries;
+    size_t bytes;
+  };
+}
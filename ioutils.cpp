@@ -1,89 +1,494 @@
 #include "ioutils.h"
+#include "parallel.h"
+
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <QImageReader>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 namespace aam {
+  bool MappedFile::Open(const string& filename) {
+    Close();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      close(fd);
+      return false;
+    }
+
+    length = st.st_size;
+    if(length > 0) {
+      void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p == MAP_FAILED) {
+        close(fd);
+        length = 0;
+        return false;
+      }
+      ptr = static_cast<const char*>(p);
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    mapped = true;
+    return true;
+  }
+
+  void MappedFile::Close() {
+    if(ptr != nullptr) munmap(const_cast<char*>(ptr), length);
+    ptr = nullptr;
+    length = 0;
+    mapped = false;
+  }
+
+  void WritePadding(ostream& fout, uint64_t& offset, uint64_t alignment) {
+    static const char zeros[256] = {0};
+    for(uint64_t aligned = AlignUp(offset, alignment); offset < aligned;) {
+      const uint64_t n = std::min<uint64_t>(aligned - offset, sizeof(zeros));
+      fout.write(zeros, n);
+      offset += n;
+    }
+  }
+
+  bool AtomicWriteFile(const string& filename, const function<void(ofstream&)>& write) {
+    const string tmp_filename = filename + ".tmp";
+    bool ok;
+    {
+      ofstream fout(tmp_filename, ios::binary);
+      ok = fout.is_open();
+      if(ok) {
+        write(fout);
+        fout.close();
+        ok = !fout.fail();
+      }
+    }
+
+    boost::system::error_code ec;
+    if(ok) boost::filesystem::rename(tmp_filename, filename, ec);
+    if(!ok || ec) {
+      boost::filesystem::remove(tmp_filename, ec);
+      cerr << "Failed to write " << filename << endl;
+      return false;
+    }
+    return true;
+  }
+
+  namespace {
+    // Non-allocating tokenizer over a mapped text file. Tokens are returned
+    // as [begin, end) ranges into the mapping.
+    struct TextScanner {
+      const char* begin;
+      const char* p;
+      const char* end;
+
+      explicit TextScanner(const MappedFile& file)
+        : begin(file.data()), p(file.data()), end(file.data() + file.size()) {}
+
+      // 1-based line of the current position, for error messages
+      int line() const {
+        return 1 + std::count(begin, p, '\n');
+      }
+
+      static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+      bool eof() const { return p >= end; }
+
+      // Skips blanks but stops at the end of the line
+      void SkipBlanks() {
+        while(p < end && is_blank(*p)) ++p;
+      }
+
+      void SkipWhitespace() {
+        while(p < end && (is_blank(*p) || *p == '\n')) ++p;
+      }
+
+      // Returns the rest of the current line and moves past its newline
+      bool NextLine(const char*& line_begin, const char*& line_end) {
+        if(p >= end) return false;
+        line_begin = p;
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        line_end = nl ? nl : end;
+        p = nl ? nl + 1 : end;
+        return true;
+      }
+
+      // Next blank separated token on the current line
+      bool NextToken(const char*& token_begin, const char*& token_end) {
+        SkipBlanks();
+        if(p >= end || *p == '\n') return false;
+        token_begin = p;
+        while(p < end && !is_blank(*p) && *p != '\n') ++p;
+        token_end = p;
+        return true;
+      }
+
+      bool ParseInt(int& v) {
+        SkipWhitespace();
+        return ParseIntHere(v);
+      }
+
+      // Integer starting right at the current position
+      bool ParseIntHere(int& v) {
+        bool negative = false;
+        if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+        if(p >= end || *p < '0' || *p > '9') return false;
+        long long r = 0;
+        while(p < end && *p >= '0' && *p <= '9') r = r * 10 + (*p++ - '0');
+        v = static_cast<int>(negative ? -r : r);
+        return true;
+      }
+
+      // Decimal floating point number with optional exponent. Exact for up to
+      // 15 significant digits and exponents within +/-22, which covers all
+      // landmark files we produce.
+      bool ParseDouble(double& v) {
+        static const double pow10[] = {
+          1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+          1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        SkipWhitespace();
+        bool negative = false;
+        if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+        uint64_t mantissa = 0;
+        int exponent = 0, ndigits = 0;
+        for(; p < end && *p >= '0' && *p <= '9'; ++p, ++ndigits) {
+          if(mantissa < 100000000000000000ULL) mantissa = mantissa * 10 + (*p - '0');
+          else ++exponent;
+        }
+        if(p < end && *p == '.') {
+          for(++p; p < end && *p >= '0' && *p <= '9'; ++p, ++ndigits) {
+            if(mantissa < 100000000000000000ULL) {
+              mantissa = mantissa * 10 + (*p - '0');
+              --exponent;
+            }
+          }
+        }
+        if(ndigits == 0) return false;
+
+        if(p < end && (*p == 'e' || *p == 'E')) {
+          int e;
+          ++p;
+          if(!ParseIntHere(e)) return false;
+          exponent += e;
+        }
+
+        double r = static_cast<double>(mantissa);
+        if(exponent < 0 && exponent >= -22) r /= pow10[-exponent];
+        else if(exponent > 0 && exponent <= 22) r *= pow10[exponent];
+        else if(exponent != 0) r *= std::pow(10.0, exponent);
+
+        v = negative ? -r : r;
+        return true;
+      }
+    };
+
+    size_t count_lines(const MappedFile& file) {
+      size_t n = 0;
+      const char* p = file.data();
+      const char* end = p + file.size();
+      while(p < end) {
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        ++n;
+        if(!nl) break;
+        p = nl + 1;
+      }
+      return n;
+    }
+  }
+
   vector<string> ReadFileByLine(const string &filename) {
-    ifstream fin(filename);
+    MappedFile file(filename);
+    TextScanner scanner(file);
+
     vector<string> lines;
-    while (fin) {
-      string line;
-      std::getline(fin, line);
-      if (!line.empty())
-        lines.push_back(line);
+    lines.reserve(count_lines(file));
+
+    const char *b, *e;
+    while(scanner.NextLine(b, e)) {
+      if (b != e)
+        lines.emplace_back(b, e);
     }
     return lines;
   }
 
   vector<pair<string, string>> ParseSettingsFile(const string& filename) {
-    vector<string> lines = ReadFileByLine(filename);
-
-    vector<pair<string, string>> image_points_filenames(lines.size());
-    std::transform(lines.begin(), lines.end(), image_points_filenames.begin(),
-                   [](const string &line) {
-                     vector<string> parts;
-                     boost::algorithm::split(parts, line,
-                                             boost::algorithm::is_any_of(" "),
-                                             boost::algorithm::token_compress_on);
-                     auto parts_end = std::remove_if(parts.begin(), parts.end(),
-                                                     [](const string &s) {
-                                                       return s.empty();
-                                                     });
-                     assert(std::distance(parts.begin(), parts_end) == 2);
-                     return make_pair(parts.front(), parts.back());
-                   });
+    MappedFile file(filename);
+    TextScanner scanner(file);
+
+    vector<pair<string, string>> image_points_filenames;
+    image_points_filenames.reserve(count_lines(file));
+
+    // Each non-empty line holds an image filename and a points filename
+    for(int line_number=1;!scanner.eof();++line_number) {
+      const char* line_begin = scanner.p;
+      const char* tokens[3][2];
+      int ntokens = 0;
+      while(ntokens < 3 && scanner.NextToken(tokens[ntokens][0], tokens[ntokens][1])) ++ntokens;
+
+      // move on to the next line
+      const char *b, *line_end;
+      scanner.NextLine(b, line_end);
+
+      if(ntokens == 0) continue;
+      if(ntokens != 2) {
+        while(line_end > line_begin && TextScanner::is_blank(line_end[-1])) --line_end;
+        cerr << "Malformed line " << line_number << " in " << filename
+             << ", expected an image and a points filename: " << string(line_begin, line_end) << endl;
+        assert(ntokens == 2);
+        continue;
+      }
+      image_points_filenames.emplace_back(string(tokens[0][0], tokens[0][1]),
+                                          string(tokens[1][0], tokens[1][1]));
+    }
     return image_points_filenames;
   }
 
   cv::Mat ReadPoints(const string& filename) {
-    ifstream fin(filename);
-    int npoints;
-    fin >> npoints;
-    cout << "reading " << npoints << " points ..." << endl;
+    MappedFile file(filename);
+    if(!file.is_open()) {
+      cerr << "Failed to open points file " << filename << endl;
+      return cv::Mat(0, 2, CV_64FC1);
+    }
+    TextScanner scanner(file);
+
+    int npoints = 0;
+    if(!scanner.ParseInt(npoints) || npoints < 0) {
+      cerr << "Malformed point count on line " << scanner.line() << " in " << filename << endl;
+      return cv::Mat(0, 2, CV_64FC1);
+    }
+
     cv::Mat pts(npoints, 2, CV_64FC1);
-    for(int i=0;i<npoints;++i) {
-      double x, y;
-      fin >> x >> y;
-      pts.at<double>(i, 0) = x;
-      pts.at<double>(i, 1) = y;
+    double* ptr = pts.ptr<double>(0);
+    for(int i=0;i<npoints*2;++i) {
+      if(!scanner.ParseDouble(ptr[i])) {
+        cerr << "Failed to parse point " << i / 2 << " of " << npoints
+             << " on line " << scanner.line() << " in " << filename << endl;
+        return pts.rowRange(0, i / 2).clone();
+      }
     }
 
     return pts;
   }
 
+  cv::Mat LoadPoints(const string& points_filename) {
+    auto pts = ReadPoints(points_filename);
+
+    // Convert points to 0-based coordinates
+    pts -= 1;
+
+    return pts;
+  }
+
+  namespace {
+    pair<QImage, cv::Mat> load_image_points_pair(const string& image_filename,
+                                                 const string& points_filename) {
+      QImage img(image_filename.c_str());
+      return make_pair(img, LoadPoints(points_filename));
+    }
+
+    // Decoded size of an image, read from the file header without decoding it
+    size_t estimate_decoded_bytes(const string& image_filename) {
+      QSize sz = QImageReader(image_filename.c_str()).size();
+      if(!sz.isValid()) return 0;
+      return static_cast<size_t>(sz.width()) * sz.height() * 4;
+    }
+  }
+
   pair<QImage, cv::Mat> LoadImagePointsPair(
     const string& image_filename,
     const string& points_filename
   ) {
-    QImage img(image_filename.c_str());
+    QImage img;
+    cv::Mat pts;
+    tie(img, pts) = load_image_points_pair(image_filename, points_filename);
     cout << "image size: " << img.width() << "x" << img.height() << endl;
-
-    auto pts = ReadPoints(points_filename);
     cout << "number of points: " << pts.rows << endl;
 
-    // Convert points to 0-based coordinates
-    pts -= 1;
-
     return make_pair(img, pts);
   }
 
+  void ForEachImagePointsPair(
+    const vector<pair<string, string>>& image_points_filenames,
+    const std::function<void(int, QImage&, cv::Mat&)>& consumer,
+    const LoaderOptions& options
+  ) {
+    const int nentries = image_points_filenames.size();
+    if(nentries == 0) return;
+
+    const int nthreads = std::min(nentries,
+                                  options.nthreads > 0 ? options.nthreads : DefaultThreadCount());
+
+    struct Entry {
+      QImage image;
+      cv::Mat points;
+      size_t bytes = 0;
+      bool ready = false;
+    };
+    vector<Entry> entries(nentries);
+
+    std::mutex mtx;
+    std::condition_variable cv_budget, cv_ready;
+    int next_entry = 0;     // next entry to be claimed by a worker
+    int next_reserve = 0;   // budget is granted strictly in entry order
+    size_t inflight = 0;
+
+    auto worker = [&]() {
+      while(true) {
+        int i;
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          if(next_entry >= nentries) return;
+          i = next_entry++;
+        }
+
+        const string& image_filename = image_points_filenames[i].first;
+        const string& points_filename = image_points_filenames[i].second;
+        size_t bytes = estimate_decoded_bytes(image_filename);
+
+        // Reserve memory for the decoded image. Reservations are granted in
+        // entry order so the entry the consumer waits for is never starved
+        // by entries decoded ahead of it. A single entry larger than the
+        // budget is let through once nothing else is in flight.
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cv_budget.wait(lock, [&]() {
+            return next_reserve == i &&
+                   (inflight == 0 || inflight + bytes <= options.max_inflight_bytes);
+          });
+          inflight += bytes;
+          ++next_reserve;
+        }
+        cv_budget.notify_all();
+
+        QImage img;
+        cv::Mat pts;
+        tie(img, pts) = load_image_points_pair(image_filename, points_filename);
+
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          // Account for the actual decoded size
+          size_t actual = static_cast<size_t>(img.bytesPerLine()) * img.height();
+          inflight = inflight - bytes + actual;
+          entries[i].image = img;
+          entries[i].points = pts;
+          entries[i].bytes = actual;
+          entries[i].ready = true;
+        }
+        cv_ready.notify_all();
+      }
+    };
+
+    vector<std::thread> threads;
+    for(int t=0;t<nthreads;++t) threads.emplace_back(worker);
+
+    for(int i=0;i<nentries;++i) {
+      QImage img;
+      cv::Mat pts;
+      size_t bytes;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_ready.wait(lock, [&]() { return entries[i].ready; });
+        std::swap(img, entries[i].image);
+        std::swap(pts, entries[i].points);
+        bytes = entries[i].bytes;
+      }
+
+      consumer(i, img, pts);
+
+      // The consumer owns the data now, the loader no longer holds on to it
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        inflight -= bytes;
+      }
+      cv_budget.notify_all();
+    }
+
+    for(auto& t : threads) t.join();
+  }
+
+  pair<vector<QImage>, vector<cv::Mat>> LoadImagePointsPairs(
+    const vector<pair<string, string>>& image_points_filenames,
+    const LoaderOptions& options
+  ) {
+    const int nentries = image_points_filenames.size();
+    vector<QImage> images(nentries);
+    vector<cv::Mat> points(nentries);
+
+    ForEachImagePointsPair(image_points_filenames,
+                           [&](int i, QImage& img, cv::Mat& pts) {
+                             images[i] = img;
+                             points[i] = pts;
+                           },
+                           options);
+
+    return make_pair(images, points);
+  }
+
+  vector<cv::Mat> LoadPointsFiles(const vector<string>& points_filenames, int nthreads) {
+    vector<cv::Mat> points(points_filenames.size());
+    ParallelFor(points_filenames.size(), [&](int i) {
+      points[i] = LoadPoints(points_filenames[i]);
+    }, nthreads);
+    return points;
+  }
+
   vector<cv::Vec3i> LoadTriangulation(const string& filename) {
-    vector<string> lines = ReadFileByLine(filename);
-
-    vector<cv::Vec3i> triangles(lines.size());
-    std::transform(lines.begin(), lines.end(), triangles.begin(),
-                   [](const string &line) {
-                     vector<string> parts;
-                     boost::algorithm::split(parts, line,
-                                             boost::algorithm::is_any_of(" \t"),
-                                             boost::algorithm::token_compress_on);
-                     auto parts_end = std::remove_if(parts.begin(), parts.end(),
-                                                     [](const string &s) {
-                                                       return s.empty();
-                                                     });
-                     assert(std::distance(parts.begin(), parts_end) == 3);
-                     return cv::Vec3i(stoi(parts[0]), stoi(parts[1]), stoi(parts[2]));
-                   });
+    MappedFile file(filename);
+    if(!file.is_open()) {
+      cerr << "Failed to open triangulation file " << filename << endl;
+      return vector<cv::Vec3i>();
+    }
+    TextScanner scanner(file);
+
+    vector<cv::Vec3i> triangles;
+    triangles.reserve(count_lines(file));
+
+    // Each non-empty line holds the three vertex indices of a triangle. A
+    // partial mesh would go unnoticed, so any other line fails the whole file.
+    for(int line_number=1;!scanner.eof();++line_number) {
+      const char* line_begin = scanner.p;
+      scanner.SkipBlanks();
+      if(scanner.eof() || *scanner.p == '\n') {
+        const char *b, *e;
+        scanner.NextLine(b, e);
+        continue;
+      }
+
+      cv::Vec3i f;
+      bool ok = true;
+      for(int k=0;k<3 && ok;++k) {
+        scanner.SkipBlanks();
+        ok = scanner.ParseIntHere(f[k]) && (scanner.eof() || TextScanner::is_blank(*scanner.p) || *scanner.p == '\n');
+      }
+      scanner.SkipBlanks();
+      ok = ok && (scanner.eof() || *scanner.p == '\n');
+
+      const char *b, *line_end;
+      scanner.p = line_begin;
+      scanner.NextLine(b, line_end);
+      if(!ok) {
+        while(line_end > line_begin && TextScanner::is_blank(line_end[-1])) --line_end;
+        cerr << "Malformed line " << line_number << " in " << filename
+             << ", expected three vertex indices: " << string(line_begin, line_end) << endl;
+        assert(ok);
+        return vector<cv::Vec3i>();
+      }
+      triangles.push_back(f);
+    }
     return triangles;
   }
 }
@@ -3,8 +3,72 @@
 #include "common.h"
 
 namespace aam {
+  // Read-only memory mapping of a whole file. Pages are loaded lazily by the
+  // OS on first access.
+  class MappedFile {
+  public:
+    MappedFile() : ptr(nullptr), length(0), mapped(false) {}
+    explicit MappedFile(const std::string& filename) : MappedFile() { Open(filename); }
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::string& filename);
+    void Close();
+
+    bool is_open() const { return mapped; }
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+
+  private:
+    const char* ptr;
+    size_t length;
+    bool mapped;
+  };
+
+  // Rounds offset up to the next multiple of alignment
+  inline uint64_t AlignUp(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // Writes zeros to fout up to the next multiple of alignment. offset is the
+  // position of fout and is moved past the padding.
+  void WritePadding(std::ostream& fout, uint64_t& offset, uint64_t alignment);
+
+  // Writes filename through write, which gets a stream on a temporary file
+  // next to it. The temporary file only replaces filename once write has
+  // returned and every write succeeded, so an interrupted or failed run
+  // never leaves a truncated file behind. Returns false if it failed.
+  bool AtomicWriteFile(const std::string& filename,
+                       const std::function<void(std::ofstream&)>& write);
+
   std::vector<std::string> ReadFileByLine(const std::string &filename);
   std::vector<std::pair<std::string, std::string>> ParseSettingsFile(const std::string& settings_filename);
+  // Reads a .pts file and converts the points to 0-based coordinates
+  cv::Mat LoadPoints(const std::string& points_filename);
+  // Loads many .pts files in parallel, 0-based like LoadPoints
+  std::vector<cv::Mat> LoadPointsFiles(const std::vector<std::string>& points_filenames,
+                                       int nthreads = 0);
   std::pair<QImage,  cv::Mat> LoadImagePointsPair(const std::string& image_filename, const std::string& points_filename);
+
+  struct LoaderOptions {
+    int nthreads = 0;                           //!< decode workers, 0 uses one per core
+    size_t max_inflight_bytes = size_t(1) << 30; //!< cap on decoded bytes not yet consumed
+  };
+
+  // Decodes all (image, points) pairs on a worker pool and hands them to
+  // consumer one at a time, in the order of image_points_filenames, on the
+  // calling thread. Workers stop decoding ahead once the decoded but not yet
+  // consumed images exceed max_inflight_bytes.
+  void ForEachImagePointsPair(
+    const std::vector<std::pair<std::string, std::string>>& image_points_filenames,
+    const std::function<void(int, QImage&, cv::Mat&)>& consumer,
+    const LoaderOptions& options = LoaderOptions());
+
+  std::pair<std::vector<QImage>, std::vector<cv::Mat>> LoadImagePointsPairs(
+    const std::vector<std::pair<std::string, std::string>>& image_points_filenames,
+    const LoaderOptions& options = LoaderOptions());
+
   std::vector<cv::Vec3i> LoadTriangulation(const std::string& filename);
 }
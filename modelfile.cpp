@@ -0,0 +1,100 @@
+#include "modelfile.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace aam {
+  namespace {
+    const char model_magic[8] = {'A', 'A', 'M', 'M', 'O', 'D', 'L', '\0'};
+    const uint32_t model_version = 1;
+    const size_t model_alignment = 64;
+
+    inline uint64_t section_bytes(const ModelFile::ModelSection& s) {
+      return uint64_t(s.rows) * s.cols * CV_ELEM_SIZE(s.type);
+    }
+
+    // Whether section s lies within a file of size bytes. Every bound is
+    // checked by division or subtraction so corrupt fields cannot wrap the
+    // arithmetic around, section_bytes is safe to call once this passes.
+    bool section_fits(const ModelFile::ModelSection& s, uint64_t size) {
+      if(s.rows < 0 || s.cols < 0) return false;
+      if(s.offset > size) return false;
+      const uint64_t available = size - s.offset;
+      if(s.cols != 0 && uint64_t(s.rows) > available / uint64_t(s.cols)) return false;
+      const uint64_t elements = uint64_t(s.rows) * s.cols;
+      return elements <= available / CV_ELEM_SIZE(s.type);
+    }
+  }
+
+  bool ModelFile::Open(const string& filename) {
+    header = nullptr;
+    sections = nullptr;
+
+    if(!file.Open(filename)) return false;
+    if(file.size() < sizeof(ModelHeader)) return false;
+
+    const ModelHeader* h = reinterpret_cast<const ModelHeader*>(file.data());
+    if(memcmp(h->magic, model_magic, sizeof(model_magic)) != 0) return false;
+    if(h->version != model_version || h->nsections != NumSections) return false;
+    if(h->nsections > (file.size() - sizeof(ModelHeader)) / sizeof(ModelSection)) return false;
+
+    const ModelSection* s = reinterpret_cast<const ModelSection*>(file.data() + sizeof(ModelHeader));
+    for(int i=0;i<NumSections;++i) {
+      const int depth = CV_MAT_DEPTH(s[i].type);
+      if(s[i].type != CV_MAT_TYPE(s[i].type)) return false;
+      if(depth != CV_32S && depth != CV_32F && depth != CV_64F) return false;
+      if(s[i].offset % model_alignment != 0) return false;
+      if(!section_fits(s[i], file.size())) return false;
+    }
+
+    header = h;
+    sections = s;
+    return true;
+  }
+
+  cv::Mat ModelFile::Get(Section s) const {
+    const ModelSection& e = sections[s];
+    return cv::Mat(e.rows, e.cols, e.type, const_cast<char*>(file.data() + e.offset));
+  }
+
+  bool SaveModelFile(const string& filename, cv::Size frame_size,
+                     const vector<cv::Mat>& mats) {
+    assert(mats.size() == ModelFile::NumSections);
+
+    ModelFile::ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, model_magic, sizeof(model_magic));
+    header.version = model_version;
+    header.nsections = mats.size();
+    header.width = frame_size.width;
+    header.height = frame_size.height;
+
+    // Every size is known up front, so the table is laid out before writing
+    vector<ModelFile::ModelSection> table(mats.size());
+    uint64_t offset = sizeof(header) + table.size() * sizeof(ModelFile::ModelSection);
+    for(size_t i=0;i<mats.size();++i) {
+      ModelFile::ModelSection& s = table[i];
+      memset(&s, 0, sizeof(s));
+      s.rows = mats[i].rows;
+      s.cols = mats[i].cols;
+      s.type = mats[i].type();
+      s.offset = AlignUp(offset, model_alignment);
+      offset = s.offset + section_bytes(s);
+    }
+
+    return AtomicWriteFile(filename, [&](ofstream& fout) {
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      fout.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(table[0]));
+      offset = sizeof(header) + table.size() * sizeof(table[0]);
+
+      for(size_t i=0;i<mats.size();++i) {
+        WritePadding(fout, offset, model_alignment);
+        assert(offset == table[i].offset);
+        cv::Mat m = mats[i].isContinuous() ? mats[i] : mats[i].clone();
+        fout.write(reinterpret_cast<const char*>(m.data), section_bytes(table[i]));
+        offset += section_bytes(table[i]);
+      }
+    });
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+#include "ioutils.h"
+
+namespace aam {
+
+  // Read-only view of a saved AAM model. The file holds every matrix of the
+  // model behind a header and a section table, with each section aligned to
+  // a 64-byte boundary and stored as raw row-major elements:
+  //
+  //   ModelHeader | ModelSection[nsections] | section 0 | section 1 | ...
+  //
+  // The file is mmapped and the sections are handed out as Mats sharing
+  // memory with the mapping, so opening a model costs no parsing or copying.
+  class ModelFile {
+  public:
+    enum Section {
+      MeanShape = 0,        //!< 1 x 2*npoints CV_64FC1, in the texture space
+      Triangles,            //!< ntriangles x 3 CV_32SC1
+      TexelOffsets,         //!< 1 x ntriangles+1 CV_32SC1, see TexelIndex
+      TexelRows,            //!< 1 x ntexels CV_32SC1
+      TexelCols,            //!< 1 x ntexels CV_32SC1
+      MeanTexture,          //!< 1 x ntexels texel_type
+      ShapeMean,            //!< 1 x 2*npoints CV_64FC1
+      ShapeEigenvalues,     //!< ncomponents x 1 CV_64FC1
+      ShapeEigenvectors,    //!< ncomponents x 2*npoints CV_64FC1
+      TextureMean,          //!< 1 x 3*ntexels, depth of texel_type
+      TextureEigenvalues,   //!< ncomponents x 1, depth of texel_type
+      TextureEigenvectors,  //!< ncomponents x 3*ntexels, depth of texel_type
+      NumSections
+    };
+
+    struct ModelHeader {
+      char magic[8];          //!< "AAMMODL\0"
+      uint32_t version;
+      uint32_t nsections;
+      int32_t width, height;  //!< size of the texture space
+    };
+
+    struct ModelSection {
+      uint64_t offset;        //!< file offset of the elements
+      int32_t rows, cols, type, reserved;
+    };
+
+    // Maps filename. Returns false if the file is missing, corrupt or of
+    // another version.
+    bool Open(const std::string& filename);
+
+    bool is_open() const { return header != nullptr; }
+    cv::Size FrameSize() const { return cv::Size(header->width, header->height); }
+
+    // The Mat shares memory with the mapping, it must not be written to and
+    // must not outlive it
+    cv::Mat Get(Section s) const;
+
+  private:
+    MappedFile file;
+    const ModelHeader* header = nullptr;
+    const ModelSection* sections = nullptr;
+  };
+
+  // Writes the matrices of a model, one per Section in order, to filename.
+  // Returns false if the file could not be written.
+  bool SaveModelFile(const std::string& filename, cv::Size frame_size,
+                     const std::vector<cv::Mat>& sections);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aam {
+
+  // Number of worker threads to use when the caller passes 0
+  inline int DefaultThreadCount() {
+    const unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : static_cast<int>(n);
+  }
+
+  // Process wide pool of DefaultThreadCount() - 1 workers, started on first
+  // use and joined at exit. The thread submitting a job works on it too, so
+  // a job runs on up to one thread per core. Jobs are submitted one at a
+  // time; a job submitted from inside another one runs on its caller alone.
+  class ThreadPool {
+  public:
+    static ThreadPool& Instance() {
+      static ThreadPool pool(DefaultThreadCount() - 1);
+      return pool;
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+      }
+      wake.notify_all();
+      for(auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return workers.size(); }
+
+    // Slot of the calling thread: 1 to size() on the pool workers, 0 on any
+    // other thread
+    static int WorkerIndex() { return worker_index(); }
+
+    // Whether the calling thread is running a job
+    static bool InJob() { return in_job(); }
+
+    // Runs f(i) for every i in [0, n) on the calling thread and up to
+    // nhelpers pool workers, returns once all are done
+    void Run(int n, const std::function<void(int)>& f, int nhelpers) {
+      std::lock_guard<std::mutex> submit(submit_mtx);
+      in_job() = true;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        job = &f;
+        njobs = n;
+        next = 0;
+        helpers = std::min(nhelpers, size());
+        running = helpers;
+        ++generation;
+      }
+      wake.notify_all();
+
+      Work();
+
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        done.wait(lock, [this]() { return running == 0; });
+        job = nullptr;
+      }
+      in_job() = false;
+    }
+
+  private:
+    explicit ThreadPool(int nworkers) {
+      for(int t=0;t<nworkers;++t) workers.emplace_back([this, t]() { WorkerLoop(t + 1); });
+    }
+
+    static int& worker_index() { static thread_local int index = 0; return index; }
+    static bool& in_job() { static thread_local bool b = false; return b; }
+
+    // Indices are handed out one at a time, so uneven items still balance
+    void Work() {
+      for(int i = next++; i < njobs; i = next++) (*job)(i);
+    }
+
+    void WorkerLoop(int index) {
+      worker_index() = index;
+      in_job() = true;
+
+      uint64_t seen = 0;
+      std::unique_lock<std::mutex> lock(mtx);
+      for(;;) {
+        wake.wait(lock, [&]() { return stop || generation != seen; });
+        if(stop) return;
+        seen = generation;
+        // the submitter waits for every helper, so none misses its job
+        if(index > helpers) continue;
+
+        lock.unlock();
+        Work();
+        lock.lock();
+        if(--running == 0) done.notify_one();
+      }
+    }
+
+    std::vector<std::thread> workers;
+
+    std::mutex submit_mtx;  //!< held by the submitter for the whole job
+    std::mutex mtx;
+    std::condition_variable wake, done;
+
+    // Current job, written under mtx before the workers are woken
+    const std::function<void(int)>* job = nullptr;
+    int njobs = 0;
+    int helpers = 0;
+    int running = 0;        //!< helpers that have not finished the job yet
+    uint64_t generation = 0;
+    std::atomic<int> next{0};
+    bool stop = false;
+  };
+
+  // Runs f(i) for every i in [0, n) on nthreads threads of the pool (0 means
+  // one per core). The calling thread takes part in the work and returns
+  // once all are done. Called from inside another ParallelFor it runs
+  // sequentially on the calling thread.
+  template <typename F>
+  void ParallelFor(int n, F f, int nthreads = 0) {
+    if(nthreads <= 0) nthreads = DefaultThreadCount();
+    nthreads = std::min(nthreads, n);
+
+    if(nthreads <= 1 || ThreadPool::InJob()) {
+      for(int i=0;i<n;++i) f(i);
+      return;
+    }
+
+    ThreadPool::Instance().Run(n, [&f](int i) { f(i); }, nthreads - 1);
+  }
+
+  // One T per thread that can run a ParallelFor item, for scratch buffers
+  // that are reused across the items instead of being allocated by each.
+  // local() must only be called from the items of a ParallelFor, which run
+  // on the pool workers and on a single calling thread.
+  template <typename T>
+  class PerThread {
+  public:
+    PerThread() : slots(ThreadPool::Instance().size() + 1) {}
+
+    T& local() { return slots[ThreadPool::WorkerIndex()]; }
+
+  private:
+    std::vector<T> slots;
+  };
+
+}
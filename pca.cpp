@@ -0,0 +1,668 @@
+#include "pca.h"
+#include "parallel.h"
+
+#include <limits>
+#include <random>
+
+namespace aam {
+
+  namespace {
+    // Columns of data handled at a time, bounds the temporaries to n x block
+    const int gram_block_cols = 1024;
+
+    // Number of components cv::PCA keeps for retained_variance, eigenvalues
+    // in descending order. total is the sum of all eigenvalues, which may
+    // be more than the ones given.
+    int ComponentCount(const Eigen::VectorXd& eigenvalues, double retained_variance, double total) {
+      const int n = eigenvalues.size();
+      double energy = 0;
+      int L = 0;
+      for(;L<n;++L) {
+        energy += eigenvalues(L);
+        if(energy / total > retained_variance) break;
+      }
+      return std::min(n, std::max(2, L));
+    }
+
+    template <typename Matrix>
+    void Orthonormalize(Matrix& Y) {
+      Eigen::HouseholderQR<Matrix> qr(Y);
+      Y = qr.householderQ() * Matrix::Identity(Y.rows(), Y.cols());
+    }
+
+    template <typename T>
+    void ComputePCA_Gram(const cv::Mat& data, double retained_variance, cv::PCA& pca) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+      typedef Eigen::Matrix<T, 1, Eigen::Dynamic> RowVector;
+
+      const int n = data.rows, d = data.cols;
+      const cv::Mat data_c = data.isContinuous() ? data : data.clone();
+      Eigen::Map<const RowMatrix> D(data_c.ptr<T>(0), n, d);
+
+      pca.mean.create(1, d, cv::DataType<T>::type);
+      Eigen::Map<RowVector> mu(pca.mean.ptr<T>(0), d);
+      mu = D.colwise().mean();
+
+      // Gram matrix of the centered rows, only its lower half is accumulated
+      Matrix G = Matrix::Zero(n, n);
+      Matrix X(n, std::min(d, gram_block_cols));
+      for(int c=0;c<d;c+=gram_block_cols) {
+        const int w = std::min(gram_block_cols, d - c);
+        X.leftCols(w) = D.middleCols(c, w).rowwise() - mu.segment(c, w);
+        G.template selfadjointView<Eigen::Lower>().rankUpdate(X.leftCols(w));
+      }
+
+      // Eigen returns the eigenvalues in ascending order. The covariance is
+      // scaled by 1 / n like cv::PCA does, its eigenvalues are the Gram ones
+      // over n.
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(G.template cast<double>());
+      const Eigen::VectorXd eigenvalues = solver.eigenvalues().reverse().cwiseMax(0.0) / n;
+      const int L = ComponentCount(eigenvalues, retained_variance, eigenvalues.sum());
+
+      // Basis vector l is X^T v_l for the Gram eigenvector v_l, normalized
+      Matrix V(n, L);
+      for(int l=0;l<L;++l) V.col(l) = solver.eigenvectors().col(n - 1 - l).template cast<T>();
+
+      pca.eigenvectors.create(L, d, cv::DataType<T>::type);
+      Eigen::Map<RowMatrix> E(pca.eigenvectors.ptr<T>(0), L, d);
+      for(int c=0;c<d;c+=gram_block_cols) {
+        const int w = std::min(gram_block_cols, d - c);
+        X.leftCols(w) = D.middleCols(c, w).rowwise() - mu.segment(c, w);
+        E.middleCols(c, w).noalias() = V.transpose() * X.leftCols(w);
+      }
+      for(int l=0;l<L;++l) {
+        const T norm = E.row(l).norm();
+        if(norm > 0) E.row(l) /= norm;
+      }
+
+      pca.eigenvalues.create(L, 1, cv::DataType<T>::type);
+      for(int l=0;l<L;++l) pca.eigenvalues.at<T>(l, 0) = eigenvalues(l);
+    }
+
+    template <typename T>
+    void ComputePCA_Randomized(const cv::Mat& data, double retained_variance,
+                               const PCAOptions& options, cv::PCA& pca) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+      typedef Eigen::Matrix<T, 1, Eigen::Dynamic> RowVector;
+
+      const int n = data.rows, d = data.cols;
+      const cv::Mat data_c = data.isContinuous() ? data : data.clone();
+      Eigen::Map<const RowMatrix> D(data_c.ptr<T>(0), n, d);
+
+      pca.mean.create(1, d, cv::DataType<T>::type);
+      Eigen::Map<RowVector> mu(pca.mean.ptr<T>(0), d);
+      mu = D.colwise().mean();
+
+      // The centered data X = D - 1 mu is never formed, the products below
+      // center one chunk of it at a time. Subtracting mu afterwards instead
+      // would cancel badly in single precision. The chunks are spread over
+      // the threads and each writes its own rows of the result, so the
+      // result does not depend on the thread count.
+      const int row_chunk = 64;
+      const int nrow_chunks = (n + row_chunk - 1) / row_chunk;
+      const int ncol_chunks = (d + gram_block_cols - 1) / gram_block_cols;
+
+      // Y = X W, W is d x b
+      auto times = [&](const Matrix& W, Matrix& Y) {
+        Y.resize(n, W.cols());
+        ParallelFor(nrow_chunks, [&](int c) {
+          const int r0 = c * row_chunk, m = std::min(row_chunk, n - r0);
+          const RowMatrix X = D.middleRows(r0, m).rowwise() - mu;
+          Y.middleRows(r0, m).noalias() = X * W;
+        }, options.nthreads);
+      };
+      // Z = X^T Y, Y is n x b
+      auto times_transpose = [&](const Matrix& Y, Matrix& Z) {
+        Z.resize(d, Y.cols());
+        ParallelFor(ncol_chunks, [&](int c) {
+          const int c0 = c * gram_block_cols, w = std::min(gram_block_cols, d - c0);
+          const Matrix X = D.middleCols(c0, w).rowwise() - mu.segment(c0, w);
+          Z.middleRows(c0, w).noalias() = X.transpose() * Y;
+        }, options.nthreads);
+      };
+
+      // Total variance, the squared norm of X, summed per chunk in a fixed order
+      std::vector<double> chunk_variance(ncol_chunks);
+      ParallelFor(ncol_chunks, [&](int c) {
+        const int c0 = c * gram_block_cols, w = std::min(gram_block_cols, d - c0);
+        chunk_variance[c] = (D.middleCols(c0, w).rowwise() - mu.segment(c0, w)).template cast<double>().squaredNorm();
+      }, options.nthreads);
+      double total = 0;
+      for(double v : chunk_variance) total += v;
+
+      // Q is an orthonormal basis of the range found so far and Bt = X^T Q,
+      // so Q Bt^T approximates X and captures the squared norm of Bt
+      const int max_rank = std::min(n, d);
+      Matrix Q(n, 0), Bt(d, 0), W, Y, Bt_b;
+      double captured = 0;
+
+      std::mt19937_64 rng(options.seed);
+      std::normal_distribution<double> normal;
+
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver;
+      int L = 0;
+      while(total > 0) {
+        const int b = std::min(options.block_size, max_rank - static_cast<int>(Q.cols()));
+        W.resize(d, b);
+        for(int j=0;j<b;++j) for(int i=0;i<d;++i) W(i, j) = normal(rng);
+
+        times(W, Y);
+        for(int p=0;p<options.power_iterations;++p) {
+          Orthonormalize(Y);
+          times_transpose(Y, W);
+          Orthonormalize(W);
+          times(W, Y);
+        }
+
+        // Remove the directions already found. Each pass starts from
+        // orthonormal columns, otherwise the columns of the block that are
+        // nearly inside the basis come back out of the QR at full size but
+        // not orthogonal to it in single precision.
+        for(int r=0;r<2;++r) {
+          Orthonormalize(Y);
+          Y -= Q * (Q.transpose() * Y);
+        }
+        Orthonormalize(Y);
+
+        times_transpose(Y, Bt_b);
+        const double added = Bt_b.template cast<double>().squaredNorm();
+        captured += added;
+
+        Q.conservativeResize(n, Q.cols() + b);
+        Q.rightCols(b) = Y;
+        Bt.conservativeResize(d, Bt.cols() + b);
+        Bt.rightCols(b) = Bt_b;
+
+        const int k = Q.cols();
+        const bool exhausted = k >= max_rank || added < options.tolerance * total;
+        if(!exhausted && captured / total <= retained_variance) continue;
+
+        // Squared singular values of Q^T X from the k x k matrix Bt^T Bt
+        const Eigen::MatrixXd Bt_d = Bt.template cast<double>();
+        solver.compute(Bt_d.transpose() * Bt_d);
+        L = ComponentCount(solver.eigenvalues().reverse().cwiseMax(0.0), retained_variance, total);
+        if(exhausted || L + options.oversampling <= k) break;
+      }
+
+      const int k = Q.cols();
+      L = std::min(L, k);
+      Matrix U(k, L);
+      for(int l=0;l<L;++l) U.col(l) = solver.eigenvectors().col(k - 1 - l).template cast<T>();
+
+      // The basis vectors are the rows of U^T Bt^T, normalized
+      pca.eigenvectors.create(L, d, cv::DataType<T>::type);
+      Eigen::Map<RowMatrix> E(pca.eigenvectors.ptr<T>(0), L, d);
+      E.noalias() = U.transpose() * Bt.transpose();
+      for(int l=0;l<L;++l) {
+        const T norm = E.row(l).norm();
+        if(norm > 0) E.row(l) /= norm;
+      }
+
+      pca.eigenvalues.create(L, 1, cv::DataType<T>::type);
+      for(int l=0;l<L;++l) {
+        pca.eigenvalues.at<T>(l, 0) = std::max(0.0, solver.eigenvalues()(k - 1 - l)) / n;
+      }
+    }
+
+    // Gram matrix of the rows of D centered at mu, in double precision
+    template <typename T, typename DataMap, typename RowVector>
+    Eigen::MatrixXd CenteredGram(const DataMap& D, const RowVector& mu) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+      const int n = D.rows(), d = D.cols();
+      Matrix G_lower = Matrix::Zero(n, n);
+      Matrix X(n, std::min(d, gram_block_cols));
+      for(int c=0;c<d;c+=gram_block_cols) {
+        const int w = std::min(gram_block_cols, d - c);
+        X.leftCols(w) = D.middleCols(c, w).rowwise() - mu.segment(c, w);
+        G_lower.template selfadjointView<Eigen::Lower>().rankUpdate(X.leftCols(w));
+      }
+      return G_lower.template cast<double>().template selfadjointView<Eigen::Lower>();
+    }
+
+    // Eigenpairs of diag(lambda) - rho q q^T, lambda in descending order and
+    // rho > 0, through the secular equation
+    //   1 - rho sum_k q_k^2 / (lambda_k - mu) = 0
+    // (Bunch, Nielsen & Sorensen). Components with a negligible q_k keep
+    // their eigenpair, and runs of equal lambda_k are merged into one pole
+    // whose other eigenvectors are orthogonal to q. That leaves one root in
+    // each gap between the poles and one below the last. Roots are found on
+    // demand, largest first, each in O(m) per iteration, and only a root's
+    // eigenvector is ever formed.
+    class RankOneDowndate {
+    public:
+      void Reset(const Eigen::VectorXd& lambda, const Eigen::VectorXd& q, double rho) {
+        const int m = lambda.size();
+        this->rho = rho;
+        this->q = q;
+
+        const double qnorm = q.norm();
+        const double tol = 8 * std::numeric_limits<double>::epsilon() *
+                           std::max(m > 0 ? lambda(0) : 0.0, rho * qnorm * qnorm);
+
+        poles.clear();
+        weights.clear();
+        deflated.clear();
+        slot_of.assign(m, -1);
+        trace = 0;
+        for(int j=0;j<m;++j) {
+          trace += lambda(j) - rho * q(j) * q(j);
+          if(rho * std::abs(q(j)) * qnorm <= tol) {
+            deflated.push_back(lambda(j));
+          } else if(!poles.empty() && poles.back() - lambda(j) <= tol) {
+            // rotating q(j) into the pole leaves an eigenvector orthogonal to q
+            weights.back() += q(j) * q(j);
+            slot_of[j] = poles.size() - 1;
+            deflated.push_back(lambda(j));
+          } else {
+            poles.push_back(lambda(j));
+            weights.push_back(q(j) * q(j));
+            slot_of[j] = poles.size() - 1;
+          }
+        }
+        wsum = 0;
+        for(double w : weights) wsum += w;
+
+        roots.assign(poles.size(), Root());
+        next_root = next_deflated = 0;
+      }
+
+      // Sum of all eigenvalues
+      double Trace() const { return trace; }
+
+      // Next eigenvalue in descending order, false once all are taken. root
+      // is the index of the secular root it comes from, -1 for deflated ones.
+      bool Next(double& mu, int& root) {
+        const int npoles = poles.size(), ndeflated = deflated.size();
+        if(next_root < npoles) {
+          // every root lies below its pole, only solve it when it can be next
+          if(next_deflated == ndeflated || deflated[next_deflated] < poles[next_root]) {
+            const double r = Solve(next_root);
+            if(next_deflated == ndeflated || deflated[next_deflated] < r) {
+              mu = r;
+              root = next_root++;
+              return true;
+            }
+          }
+        }
+        if(next_deflated < ndeflated) {
+          mu = deflated[next_deflated++];
+          root = -1;
+          return true;
+        }
+        return false;
+      }
+
+      // Coefficient of z = rho q along the unit eigenvector of root k:
+      // q . w_k = a_k / rho by the secular equation
+      double Coefficient(int k) const { return roots[k].a; }
+
+      // t += coef * w_k in the coordinates of lambda, where w_k is
+      // proportional to q_j / (lambda_j - mu_k)
+      void AddVector(int k, double coef, Eigen::VectorXd& t) const {
+        const Root& r = roots[k];
+        const double base = poles[r.origin];
+        for(int j=0;j<t.size();++j) {
+          const int s = slot_of[j];
+          if(s < 0) continue;
+          t(j) += coef * r.a * q(j) / ((poles[s] - base) - r.tau);
+        }
+      }
+
+    private:
+      // Root k is mu = poles[origin] + tau, kept relative to the nearer pole
+      // so the differences lambda_j - mu stay accurate next to it
+      struct Root {
+        bool solved = false;
+        int origin = 0;
+        double tau = 0;
+        double a = 0;   //!< 1 / |q_j / (lambda_j - mu)|
+      };
+
+      struct Terms {
+        double h;           //!< 1 - psi - phi
+        double psi, dpsi;   //!< poles up to k, and their derivative
+        double phi, dphi;   //!< poles past k
+        double delta_k, delta_k1;  //!< distances to poles k and k + 1
+      };
+
+      Terms Evaluate(int k, int origin, double tau) const {
+        Terms t = {0, 0, 0, 0, 0, 0, 0};
+        const double base = poles[origin];
+        for(int s=0;s<static_cast<int>(poles.size());++s) {
+          const double delta = (poles[s] - base) - tau;
+          const double term = weights[s] / delta;
+          if(s <= k) { t.psi += term; t.dpsi += term / delta; }
+          else { t.phi += term; t.dphi += term / delta; }
+          if(s == k) t.delta_k = delta;
+          if(s == k + 1) t.delta_k1 = delta;
+        }
+        t.psi *= rho; t.dpsi *= rho; t.phi *= rho; t.dphi *= rho;
+        t.h = 1 - t.psi - t.phi;
+        return t;
+      }
+
+      double Solve(int k) {
+        Root& r = roots[k];
+        if(r.solved) return poles[r.origin] + r.tau;
+
+        const double eps = std::numeric_limits<double>::epsilon();
+        const bool last = k + 1 == static_cast<int>(poles.size());
+        // The root is in (poles[k+1], poles[k]); below the last pole it is
+        // at most rho |q|^2 away. h decreases from +inf to -inf over the gap.
+        const double gap = last ? rho * wsum : poles[k] - poles[k + 1];
+
+        double lo, hi;
+        if(last || Evaluate(k, k, -gap / 2).h > 0) {
+          r.origin = k;
+          lo = last ? -gap : -gap / 2;
+          hi = 0;
+        } else {
+          r.origin = k + 1;
+          lo = 0;
+          hi = gap / 2;
+        }
+
+        double tau = (lo + hi) / 2;
+        for(int iter=0;iter<100;++iter) {
+          const Terms t = Evaluate(k, r.origin, tau);
+          if(std::abs(t.h) <= 8 * eps * (1 + t.psi - t.phi)) break;
+          if(t.h > 0) lo = tau;
+          else hi = tau;
+          if(hi - lo <= 2 * eps * std::max(std::abs(lo), std::abs(hi))) break;
+
+          // Model psi and phi by one pole each, matching value and slope,
+          // and step to the root of the model in (delta_k1, delta_k)
+          const double a = t.delta_k, B = t.dpsi * a * a, A = t.psi - B / a;
+          double step = std::numeric_limits<double>::quiet_NaN();
+          if(last) {
+            const double c0 = 1 - A;
+            if(c0 > 0) step = a - B / c0;
+          } else {
+            const double b = t.delta_k1, E = t.dphi * b * b, C = t.phi - E / b;
+            const double c0 = 1 - A - C;
+            const double qa = c0, qb = -(c0 * (a + b) - B - E), qc = c0 * a * b - B * b - E * a;
+            if(qa == 0) {
+              if(qb != 0) step = -qc / qb;
+            } else {
+              const double tq = -0.5 * (qb + std::copysign(std::sqrt(std::max(0.0, qb * qb - 4 * qa * qc)), qb));
+              const double r1 = tq / qa, r2 = tq != 0 ? qc / tq : r1;
+              step = r1 > b && r1 < a ? r1 : r2;
+            }
+          }
+
+          const double next = tau + step;
+          tau = next > lo && next < hi ? next : (lo + hi) / 2;
+        }
+
+        const Terms t = Evaluate(k, r.origin, tau);
+        r.tau = tau;
+        r.a = std::sqrt(rho / (t.dpsi + t.dphi));
+        r.solved = true;
+        return poles[r.origin] + tau;
+      }
+
+      double rho = 0, trace = 0, wsum = 0;
+      Eigen::VectorXd q;
+      std::vector<double> poles, weights;  //!< merged poles and their q^2 mass
+      std::vector<double> deflated;        //!< eigenvalues kept from lambda
+      std::vector<int> slot_of;            //!< pole of each component, -1 if deflated
+      std::vector<Root> roots;
+      int next_root = 0, next_deflated = 0;
+    };
+
+    // Without row i the mean moves by -x_i / (n - 1), x_i centered, so the
+    // other rows centered at their mean are y_j = x_j + c x_i and row i is
+    // z = (1 + c) x_i, with c = 1 / (n - 1). Their scatter matrix is
+    //   sum_j y_j y_j^T = X^T X - (1 + c) x_i x_i^T
+    // In the basis u_l = X^T v_l / sqrt(lambda_l) of the eigenpairs of the
+    // Gram matrix G = X X^T, x_i has coordinates q_l = sqrt(lambda_l) V(i, l)
+    // and the scatter matrix is diag(lambda) - (1 + c) q q^T, whose
+    // eigenpairs RankOneDowndate gives in O(n) per root.
+    template <typename T>
+    void LeaveOneOut(const cv::Mat& data, double retained_variance,
+                     cv::Mat& residuals, cv::Mat* reconstructions, int nthreads) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+      typedef Eigen::Matrix<T, 1, Eigen::Dynamic> RowVector;
+
+      const int n = data.rows, d = data.cols;
+      const cv::Mat data_c = data.isContinuous() ? data : data.clone();
+      Eigen::Map<const RowMatrix> D(data_c.ptr<T>(0), n, d);
+      const RowVector mu = D.colwise().mean();
+
+      // One decomposition of the Gram matrix of all rows, the directions
+      // with no variance are dropped. Eigen returns ascending eigenvalues.
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(CenteredGram<T>(D, mu));
+      const Eigen::VectorXd all = solver.eigenvalues().reverse();
+      const double floor = n * std::numeric_limits<double>::epsilon() * std::max(0.0, all(0));
+      int m = 0;
+      while(m < n && all(m) > floor) ++m;
+      const Eigen::VectorXd lambda = all.head(m);
+      const Eigen::MatrixXd V = solver.eigenvectors().rightCols(m).rowwise().reverse();
+      const Eigen::VectorXd sqrt_lambda = lambda.cwiseSqrt();
+
+      residuals.create(1, n, CV_64FC1);
+      // Row i of B holds the weights of the data rows in the reconstruction
+      // of row i, see below
+      Eigen::MatrixXd B, T_scaled;
+      if(reconstructions) T_scaled.setZero(n, m);
+
+      const double c = 1.0 / (n - 1), rho = 1 + c;
+      PerThread<RankOneDowndate> downdates;
+      ParallelFor(n, [&](int i) {
+        RankOneDowndate& dd = downdates.local();
+        dd.Reset(lambda, sqrt_lambda.cwiseProduct(V.row(i).transpose()), rho);
+        const double total = std::max(0.0, dd.Trace());
+
+        // Components in descending order up to the retained variance cut,
+        // with the same rule as ComponentCount
+        std::vector<int> kept;
+        double energy = 0;
+        int L = -1;
+        double mu_l;
+        int root;
+        while(dd.Next(mu_l, root)) {
+          kept.push_back(root);
+          energy += std::max(0.0, mu_l);
+          if(energy / total > retained_variance) {
+            L = kept.size() - 1;
+            break;
+          }
+        }
+        if(L < 0) L = kept.size();
+        // at least two components, if there are
+        if(L < 2 && static_cast<int>(kept.size()) < 2 && dd.Next(mu_l, root)) kept.push_back(root);
+        kept.resize(std::min<int>(kept.size(), std::max(2, L)));
+
+        // z projects to a_l on each kept eigenvector, deflated ones are
+        // orthogonal to it
+        double captured = 0;
+        Eigen::VectorXd t;
+        if(reconstructions) t.setZero(m);
+        for(int k : kept) {
+          if(k < 0) continue;
+          const double a_l = dd.Coefficient(k);
+          captured += a_l * a_l;
+          if(reconstructions) dd.AddVector(k, a_l, t);
+        }
+        const double zz = rho * rho * V.row(i).cwiseAbs2().dot(lambda);
+        residuals.at<double>(0, i) = std::sqrt(std::max(0.0, zz - captured));
+
+        // sum_l t_l u_l = X^T V diag(1 / sqrt(lambda)) t
+        if(reconstructions) T_scaled.row(i) = t.cwiseQuotient(sqrt_lambda).transpose();
+      }, nthreads);
+
+      if(!reconstructions) return;
+
+      // Reconstruction mean_i + X^T beta_i in terms of the uncentered rows:
+      //   (1 + c - s) mu - c d_i + sum_j beta_ij d_j,  s = sum_j beta_ij
+      // The combinations of all rows are one product with the data.
+      B = T_scaled * V.transpose();
+      const RowMatrix B_t = B.template cast<T>();
+      reconstructions->create(n, d, cv::DataType<T>::type);
+      const int row_chunk = 64;
+      const int nchunks = (n + row_chunk - 1) / row_chunk;
+      ParallelFor(nchunks, [&](int k) {
+        const int r0 = k * row_chunk, rows = std::min(row_chunk, n - r0);
+        Eigen::Map<RowMatrix> R(reconstructions->ptr<T>(r0), rows, d);
+        R.noalias() = B_t.middleRows(r0, rows) * D;
+        for(int r=0;r<rows;++r) {
+          const double s = B.row(r0 + r).sum();
+          R.row(r) += mu * static_cast<T>(1 + c - s) - D.row(r0 + r) * static_cast<T>(c);
+        }
+      }, nthreads);
+    }
+
+    // Reference for LeaveOneOut: forms the Gram matrix of each held-out set
+    // from G and decomposes it, O(n^3) per row
+    template <typename T>
+    void LeaveOneOut_Dense(const cv::Mat& data, double retained_variance,
+                           cv::Mat& residuals, cv::Mat* reconstructions, int nthreads) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+      typedef Eigen::Matrix<T, 1, Eigen::Dynamic> RowVector;
+
+      const int n = data.rows, d = data.cols;
+      const cv::Mat data_c = data.isContinuous() ? data : data.clone();
+      Eigen::Map<const RowMatrix> D(data_c.ptr<T>(0), n, d);
+      const RowVector mu = D.colwise().mean();
+      const Eigen::MatrixXd G = CenteredGram<T>(D, mu);
+
+      residuals.create(1, n, CV_64FC1);
+      if(reconstructions) reconstructions->create(n, d, cv::DataType<T>::type);
+
+      const double c = 1.0 / (n - 1);
+      ParallelFor(n, [&](int i) {
+        auto other = [i](int a) { return a < i ? a : a + 1; };
+
+        // Gram matrix of the y_j and the products y_j . z / (1 + c)
+        Eigen::MatrixXd Gi(n - 1, n - 1);
+        Eigen::VectorXd p(n - 1);
+        for(int a=0;a<n-1;++a) {
+          const int ja = other(a);
+          p(a) = G(ja, i) + c * G(i, i);
+          for(int b=0;b<=a;++b) {
+            const int jb = other(b);
+            Gi(a, b) = G(ja, jb) + c * (G(ja, i) + G(i, jb)) + c * c * G(i, i);
+          }
+        }
+
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(Gi);
+        const Eigen::VectorXd eigenvalues = solver.eigenvalues().reverse().cwiseMax(0.0);
+        const int L = ComponentCount(eigenvalues, retained_variance, eigenvalues.sum());
+
+        // Basis vector l is u_l = Y^T v_l / sqrt(lambda_l), so z projects to
+        // a_l = (1 + c) v_l . p / sqrt(lambda_l) and its reconstruction
+        // sum_l a_l u_l is Y^T beta
+        double captured = 0;
+        Eigen::VectorXd beta = Eigen::VectorXd::Zero(n - 1);
+        for(int l=0;l<L;++l) {
+          const double lambda = eigenvalues(l);
+          if(lambda <= 0) continue;
+          const auto v = solver.eigenvectors().col(n - 2 - l);
+          const double a_l = (1 + c) * v.dot(p) / std::sqrt(lambda);
+          captured += a_l * a_l;
+          beta += v * (a_l / std::sqrt(lambda));
+        }
+        const double zz = (1 + c) * (1 + c) * G(i, i);
+        residuals.at<double>(0, i) = std::sqrt(std::max(0.0, zz - captured));
+
+        if(!reconstructions) return;
+
+        // Reconstruction mean_i + Y^T beta in terms of the uncentered rows:
+        //   (1 + c)(1 - s) mu + sum_j beta_j d_j + c (s - 1) d_i,  s = sum_j beta_j
+        const double s = beta.sum();
+        Eigen::Map<RowVector> r(reconstructions->ptr<T>(i), d);
+        r = mu * static_cast<T>((1 + c) * (1 - s)) + D.row(i) * static_cast<T>(c * (s - 1));
+        for(int a=0;a<n-1;++a) r += D.row(other(a)) * static_cast<T>(beta(a));
+      }, nthreads);
+    }
+
+    template <typename T>
+    void ProjectRowsImpl(const cv::PCA& model, const cv::Mat& data, cv::Mat& residuals,
+                         cv::Mat* reconstructions, cv::Mat* coeffs, int nthreads) {
+      typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+      typedef Eigen::Matrix<T, 1, Eigen::Dynamic> RowVector;
+
+      const int n = data.rows, d = data.cols, L = model.eigenvectors.rows;
+      assert(model.mean.cols == d && model.eigenvectors.cols == d);
+      const cv::Mat data_c = data.isContinuous() ? data : data.clone();
+      const cv::Mat mean_c = model.mean.isContinuous() ? model.mean : model.mean.clone();
+      const cv::Mat basis_c = model.eigenvectors.isContinuous() ? model.eigenvectors : model.eigenvectors.clone();
+      Eigen::Map<const RowMatrix> D(data_c.ptr<T>(0), n, d);
+      Eigen::Map<const RowVector> mu(mean_c.ptr<T>(0), d);
+      Eigen::Map<const RowMatrix> E(basis_c.ptr<T>(0), L, d);
+
+      residuals.create(1, n, CV_64FC1);
+      if(reconstructions) reconstructions->create(n, d, cv::DataType<T>::type);
+      if(coeffs) coeffs->create(n, L, cv::DataType<T>::type);
+
+      // Every chunk works on its own temporaries and rows of the outputs
+      const int row_chunk = 64;
+      const int nchunks = (n + row_chunk - 1) / row_chunk;
+      ParallelFor(nchunks, [&](int c) {
+        const int r0 = c * row_chunk, m = std::min(row_chunk, n - r0);
+        const RowMatrix X = D.middleRows(r0, m).rowwise() - mu;
+        const RowMatrix C = X * E.transpose();
+        const RowMatrix R = C * E;
+
+        for(int r=0;r<m;++r) {
+          residuals.at<double>(0, r0 + r) = (X.row(r) - R.row(r)).template cast<double>().norm();
+        }
+        if(reconstructions) {
+          Eigen::Map<RowMatrix>(reconstructions->ptr<T>(r0), m, d) = R.rowwise() + mu;
+        }
+        if(coeffs) {
+          Eigen::Map<RowMatrix>(coeffs->ptr<T>(r0), m, L) = C;
+        }
+      }, nthreads);
+    }
+  }
+
+  cv::PCA ComputePCA(const cv::Mat& data, double retained_variance, const PCAOptions& options) {
+    assert(data.channels() == 1);
+    const bool single = data.depth() == CV_32F;
+
+    cv::PCA pca;
+    if(options.backend == PCAOptions::Randomized) {
+      if(single) ComputePCA_Randomized<float>(data, retained_variance, options, pca);
+      else ComputePCA_Randomized<double>(data, retained_variance, options, pca);
+      // Constant data has no variance to capture
+      if(!pca.eigenvectors.empty()) return pca;
+    }
+
+    if(data.rows >= data.cols) return cv::PCA(data, cv::Mat(), CV_PCA_DATA_AS_ROW, retained_variance);
+
+    if(single) ComputePCA_Gram<float>(data, retained_variance, pca);
+    else ComputePCA_Gram<double>(data, retained_variance, pca);
+    return pca;
+  }
+
+  cv::Mat LeaveOneOutResiduals(const cv::Mat& data, double retained_variance,
+                               cv::Mat* reconstructions, int nthreads) {
+    assert(data.channels() == 1 && data.rows > 2);
+    cv::Mat residuals;
+    if(data.depth() == CV_32F) LeaveOneOut<float>(data, retained_variance, residuals, reconstructions, nthreads);
+    else LeaveOneOut<double>(data, retained_variance, residuals, reconstructions, nthreads);
+    return residuals;
+  }
+
+  cv::Mat LeaveOneOutResidualsReference(const cv::Mat& data, double retained_variance,
+                                        cv::Mat* reconstructions, int nthreads) {
+    assert(data.channels() == 1 && data.rows > 2);
+    cv::Mat residuals;
+    if(data.depth() == CV_32F) LeaveOneOut_Dense<float>(data, retained_variance, residuals, reconstructions, nthreads);
+    else LeaveOneOut_Dense<double>(data, retained_variance, residuals, reconstructions, nthreads);
+    return residuals;
+  }
+
+  cv::Mat ProjectRows(const cv::PCA& model, const cv::Mat& data,
+                      cv::Mat* reconstructions, cv::Mat* coeffs, int nthreads) {
+    assert(data.channels() == 1 && data.type() == model.mean.type());
+    cv::Mat residuals;
+    if(data.depth() == CV_32F) ProjectRowsImpl<float>(model, data, residuals, reconstructions, coeffs, nthreads);
+    else ProjectRowsImpl<double>(model, data, residuals, reconstructions, coeffs, nthreads);
+    return residuals;
+  }
+
+}
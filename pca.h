@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+
+namespace aam {
+
+  struct PCAOptions {
+    enum Backend {
+      Exact,       //!< full decomposition, through the Gram matrix for wide data
+      Randomized   //!< randomized range finder grown in blocks
+    };
+
+    Backend backend = Exact;
+    int block_size = 16;       //!< rank added per step of the randomized backend
+    int oversampling = 8;      //!< components beyond the cut that must be in the range before stopping
+    int power_iterations = 1;  //!< subspace iterations per block, sharpen slowly decaying spectra
+    double tolerance = 1e-4;   //!< stop growing once a block adds less than this fraction of the variance
+    uint64_t seed = 0;         //!< seed of the random test matrices, same seed gives the same model
+    int nthreads = 0;          //!< threads for the products of the randomized backend, 0 uses all cores
+  };
+
+  // Principal components of the rows of data (CV_32FC1 or CV_64FC1), same
+  // model as cv::PCA(data, Mat(), CV_PCA_DATA_AS_ROW, retained_variance) up
+  // to the signs of the eigenvectors, so project and backProject work as
+  // usual.
+  //
+  // Exact backend: texture data has far fewer rows than columns. Then the
+  // n x n Gram matrix of the centered rows is built in column blocks without
+  // a centered copy of data, the component count is picked from its
+  // eigenvalues and only the kept basis vectors are formed, which costs
+  // O(n^2 * d) instead of forming all n of them. Tall data goes to cv::PCA.
+  //
+  // Randomized backend: an orthonormal basis Q of the range of the centered
+  // data is grown block_size random directions at a time until the variance
+  // it captures passes retained_variance with oversampling components to
+  // spare, or a block adds less than tolerance of the total. The components
+  // are then read off the small matrix Q^T X. Costs O(n * d * k) for a final
+  // rank k, and only approximates the eigenvalues past the cut.
+  cv::PCA ComputePCA(const cv::Mat& data, double retained_variance,
+                     const PCAOptions& options = PCAOptions());
+
+  // Leave-one-out models of the rows of data (CV_32FC1 or CV_64FC1): row i
+  // is reconstructed by the exact model of all other rows,
+  //   ComputePCA(data without row i, retained_variance)
+  // and the residual norms are returned as a 1 x n CV_64FC1 Mat. If
+  // reconstructions is given it receives the reconstructed rows.
+  //
+  // The n models are not built. Without row i, the scatter matrix of the
+  // other rows centered at their own mean is the full one minus a rank one
+  // term. In the eigenbasis of the Gram matrix of all rows, built and
+  // decomposed once in O(n^2 * d + n^3), every held-out set is then solved
+  // from a secular equation. Its eigenvalues are found largest first until
+  // the retained_variance cut of that set, O(n) each. Each reconstruction
+  // is a combination of the rows of data, all of them formed by one product
+  // with data. Rows are processed on nthreads workers.
+  cv::Mat LeaveOneOutResiduals(const cv::Mat& data, double retained_variance,
+                               cv::Mat* reconstructions = nullptr, int nthreads = 0);
+
+  // Same results as LeaveOneOutResiduals, from a dense eigendecomposition
+  // of every held-out Gram matrix. O(n^3) per row, only meant for checking.
+  cv::Mat LeaveOneOutResidualsReference(const cv::Mat& data, double retained_variance,
+                                        cv::Mat* reconstructions = nullptr, int nthreads = 0);
+
+  // Scores every row of data (of the type of the model) against model at
+  // once: the rows are projected and back-projected like cv::PCA::project
+  // and backProject do, as two GEMMs per chunk of rows, and the residual
+  // norms |row - reconstruction| are returned as a 1 x n CV_64FC1 Mat. If
+  // given, reconstructions and coeffs receive the back-projected rows and
+  // the coefficients. Chunks run on nthreads workers; the model is only
+  // read, so several calls may share it.
+  cv::Mat ProjectRows(const cv::PCA& model, const cv::Mat& data,
+                      cv::Mat* reconstructions = nullptr, cv::Mat* coeffs = nullptr,
+                      int nthreads = 0);
+
+}
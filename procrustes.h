@@ -0,0 +1,124 @@
+#pragma once
+
+#include "common.h"
+#include "parallel.h"
+
+namespace aam {
+
+  const int default_landmark_count = 73;  //!< landmark layout of our data sets
+
+  // 2D similarity transform
+  //   x' = a * x - b * y + tx
+  //   y' = b * x + a * y + ty
+  // with a = s * cos(theta) and b = s * sin(theta).
+  struct Similarity2D {
+    double a, b, tx, ty;
+
+    // Transforms npoints interleaved (x, y) points, in and out may alias
+    void Apply(const double* in, double* out, int npoints) const {
+      for(int k=0;k<npoints;++k) {
+        const double x = in[k*2], y = in[k*2+1];
+        out[k*2] = a * x - b * y + tx;
+        out[k*2+1] = b * x + a * y + ty;
+      }
+    }
+
+    // 2x3 matrix for cv::transform and friends
+    cv::Mat ToMat() const {
+      cv::Mat tform(2, 3, CV_64FC1);
+      tform.at<double>(0, 0) = a; tform.at<double>(0, 1) = -b; tform.at<double>(0, 2) = tx;
+      tform.at<double>(1, 0) = b; tform.at<double>(1, 1) = a;  tform.at<double>(1, 2) = ty;
+      return tform;
+    }
+  };
+
+  // Least squares similarity transform (no reflection) mapping the
+  // interleaved points from onto to, whose centroid (to_cx, to_cy) is
+  // already known. This is the closed form of the 2D Umeyama solution and
+  // matches EstimateRigidTransform. A non-zero NPoints fixes the number of
+  // points at compile time so the loops can be fully unrolled.
+  template <int NPoints>
+  Similarity2D EstimateSimilarityFixed(const double* from, const double* to, int npoints,
+                                       double to_cx, double to_cy) {
+    const int n = NPoints > 0 ? NPoints : npoints;
+
+    double mpx = 0, mpy = 0;
+    for(int k=0;k<n;++k) {
+      mpx += from[k*2];
+      mpy += from[k*2+1];
+    }
+    mpx /= n;
+    mpy /= n;
+
+    // a = sum <dp, dq>, b = sum dp x dq, sp2 = sum |dp|^2
+    double a = 0, b = 0, sp2 = 0;
+    for(int k=0;k<n;++k) {
+      const double px = from[k*2] - mpx, py = from[k*2+1] - mpy;
+      const double qx = to[k*2] - to_cx, qy = to[k*2+1] - to_cy;
+      a += px * qx + py * qy;
+      b += px * qy - py * qx;
+      sp2 += px * px + py * py;
+    }
+
+    Similarity2D t;
+    t.a = sp2 > 0 ? a / sp2 : 1.0;
+    t.b = sp2 > 0 ? b / sp2 : 0.0;
+    t.tx = to_cx - (t.a * mpx - t.b * mpy);
+    t.ty = to_cy - (t.b * mpx + t.a * mpy);
+    return t;
+  }
+
+  inline void ComputeCentroid(const double* pts, int npoints, double& cx, double& cy) {
+    cx = cy = 0;
+    for(int k=0;k<npoints;++k) {
+      cx += pts[k*2];
+      cy += pts[k*2+1];
+    }
+    cx /= npoints;
+    cy /= npoints;
+  }
+
+  // Picks the compile-time specialization for our landmark layout when the
+  // point count matches it
+  inline Similarity2D EstimateSimilarity(const double* from, const double* to, int npoints,
+                                         double to_cx, double to_cy) {
+    if(npoints == default_landmark_count) {
+      return EstimateSimilarityFixed<default_landmark_count>(from, to, npoints, to_cx, to_cy);
+    }
+    return EstimateSimilarityFixed<0>(from, to, npoints, to_cx, to_cy);
+  }
+
+  inline Similarity2D EstimateSimilarity(const double* from, const double* to, int npoints) {
+    double cx, cy;
+    ComputeCentroid(to, npoints, cx, cy);
+    return EstimateSimilarity(from, to, npoints, cx, cy);
+  }
+
+  // Aligns every row of shapes, laid out as (x0, y0, x1, y1, ...), to target
+  // with the least squares similarity transform (rotation, uniform scale and
+  // translation, no reflection) and writes it to the same row of aligned.
+  //
+  // This is the batched counterpart of AlignShape: the target centroid is
+  // computed once, each transform is solved with EstimateSimilarity on the
+  // raw row pointers, and rows are processed in parallel. aligned is only
+  // allocated if it does not have the right size and type yet.
+  inline void AlignShapes(const cv::Mat& shapes, const cv::Mat& target,
+                          cv::Mat& aligned, int nthreads = 0) {
+    assert(shapes.type() == CV_64FC1 && target.type() == CV_64FC1);
+    assert(shapes.cols == target.cols);
+
+    const int nshapes = shapes.rows;
+    const int npoints = shapes.cols / 2;
+    aligned.create(nshapes, shapes.cols, CV_64FC1);
+
+    const double* q = target.ptr<double>(0);
+    double mqx, mqy;
+    ComputeCentroid(q, npoints, mqx, mqy);
+
+    ParallelFor(nshapes, [&](int i) {
+      const double* p = shapes.ptr<double>(i);
+      EstimateSimilarity(p, q, npoints, mqx, mqy).Apply(p, aligned.ptr<double>(i), npoints);
+    }, nthreads);
+  }
+
+}
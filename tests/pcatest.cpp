@@ -0,0 +1,143 @@
+#include "pca.h"
+#include "testutils.h"
+
+using namespace std;
+
+namespace {
+  // n rows of a rank 5 model with a decaying spectrum plus a little noise,
+  // of the given type (CV_32FC1 or CV_64FC1). Same seed gives the same data.
+  cv::Mat MakeData(int n, int d, int type, uint64_t seed) {
+    const int rank = 5;
+    const double sigmas[rank] = {10, 8, 6, 4, 2};
+    cv::RNG rng(seed);
+
+    cv::Mat basis(rank, d, CV_64FC1), mean(1, d, CV_64FC1);
+    for(int k=0;k<d;++k) {
+      for(int j=0;j<rank;++j) basis.at<double>(j, k) = rng.gaussian(1.0 / sqrt(double(d)));
+      mean.at<double>(0, k) = rng.gaussian(1.0);
+    }
+
+    cv::Mat data(n, d, CV_64FC1);
+    for(int i=0;i<n;++i) {
+      cv::Mat row = data.row(i);
+      mean.copyTo(row);
+      for(int j=0;j<rank;++j) row += rng.gaussian(sigmas[j]) * basis.row(j);
+      for(int k=0;k<d;++k) row.at<double>(0, k) += rng.gaussian(0.01);
+    }
+
+    cv::Mat converted;
+    data.convertTo(converted, type);
+    return converted;
+  }
+
+  // The exact backend against cv::PCA: same mean, eigenvalues and
+  // eigenvectors up to signs, and the same number of components for each
+  // retained variance. Wide data goes through the Gram matrix, tall data
+  // straight to cv::PCA.
+  void TestExactPCA(int n, int d, int type, double tolerance) {
+    cv::Mat data = MakeData(n, d, type, 3);
+    const double retained_variances[] = {0.5, 0.8, 0.95, 0.999};
+    for(double retained_variance : retained_variances) {
+      cv::PCA expected(data, cv::Mat(), CV_PCA_DATA_AS_ROW, retained_variance);
+      cv::PCA actual = aam::ComputePCA(data, retained_variance);
+
+      const int L = expected.eigenvectors.rows;
+      CHECK(actual.eigenvectors.rows == L && actual.eigenvectors.cols == d);
+      CHECK(actual.eigenvalues.rows == L);
+      if(actual.eigenvectors.rows != L || actual.eigenvalues.rows != L) continue;
+
+      cv::Mat expected_mean, actual_mean, expected_vectors, actual_vectors, expected_values, actual_values;
+      expected.mean.convertTo(expected_mean, CV_64F);
+      actual.mean.convertTo(actual_mean, CV_64F);
+      expected.eigenvectors.convertTo(expected_vectors, CV_64F);
+      actual.eigenvectors.convertTo(actual_vectors, CV_64F);
+      expected.eigenvalues.convertTo(expected_values, CV_64F);
+      actual.eigenvalues.convertTo(actual_values, CV_64F);
+
+      CHECK(cv::norm(actual_mean, expected_mean, cv::NORM_INF) <= tolerance * cv::norm(expected_mean, cv::NORM_INF));
+      for(int l=0;l<L;++l) {
+        const double lambda = expected_values.at<double>(l, 0);
+        CHECK_NEAR(actual_values.at<double>(l, 0), lambda, tolerance * lambda);
+        const double cosine = expected_vectors.row(l).dot(actual_vectors.row(l));
+        CHECK_NEAR(fabs(cosine), 1.0, tolerance);
+      }
+    }
+  }
+
+  // Every leave-one-out residual and reconstruction against a cv::PCA
+  // model built from the other rows
+  void TestLeaveOneOut(int type, double tolerance) {
+    const int n = 30, d = 400;
+    const double retained_variance = 0.95;
+    cv::Mat data = MakeData(n, d, type, 1);
+
+    cv::Mat reconstructions;
+    cv::Mat residuals = aam::LeaveOneOutResiduals(data, retained_variance, &reconstructions);
+    CHECK(residuals.type() == CV_64FC1 && residuals.rows == 1 && residuals.cols == n);
+    CHECK(reconstructions.type() == type && reconstructions.size() == data.size());
+
+    for(int i=0;i<n;++i) {
+      cv::Mat others(n - 1, d, type);
+      for(int j=0, r=0;j<n;++j) {
+        if(j == i) continue;
+        data.row(j).copyTo(others.row(r++));
+      }
+
+      cv::PCA pca(others, cv::Mat(), CV_PCA_DATA_AS_ROW, retained_variance);
+      cv::Mat expected = pca.backProject(pca.project(data.row(i)));
+      const double residual = cv::norm(data.row(i), expected);
+      const double scale = cv::norm(expected, cv::NORM_INF);
+
+      CHECK_NEAR(residuals.at<double>(0, i), residual, tolerance * residual);
+      CHECK(cv::norm(reconstructions.row(i), expected, cv::NORM_INF) <= tolerance * scale);
+    }
+  }
+
+  // The randomized backend against the exact one on data whose spectrum it
+  // captures fully: same components and the same scores, up to signs
+  void TestRandomizedPCA() {
+    const int n = 60, d = 500;
+    const double retained_variance = 0.95, tolerance = 1e-8;
+    cv::Mat data = MakeData(n, d, CV_64FC1, 2);
+
+    aam::PCAOptions options;
+    options.backend = aam::PCAOptions::Randomized;
+    options.seed = 7;
+    cv::PCA exact = aam::ComputePCA(data, retained_variance);
+    cv::PCA approx = aam::ComputePCA(data, retained_variance, options);
+
+    const int L = exact.eigenvectors.rows;
+    CHECK(approx.eigenvectors.rows == L && approx.eigenvectors.cols == d);
+    if(approx.eigenvectors.rows != L) return;
+
+    CHECK(cv::norm(approx.mean, exact.mean, cv::NORM_INF) <= tolerance);
+    for(int l=0;l<L;++l) {
+      const double lambda = exact.eigenvalues.at<double>(l, 0);
+      CHECK_NEAR(approx.eigenvalues.at<double>(l, 0), lambda, tolerance * lambda);
+      const double cosine = exact.eigenvectors.row(l).dot(approx.eigenvectors.row(l));
+      CHECK_NEAR(fabs(cosine), 1.0, tolerance);
+    }
+
+    cv::Mat exact_residuals = aam::ProjectRows(exact, data);
+    cv::Mat approx_residuals = aam::ProjectRows(approx, data);
+    for(int i=0;i<n;++i) {
+      const double residual = exact_residuals.at<double>(0, i);
+      CHECK_NEAR(approx_residuals.at<double>(0, i), residual, tolerance * cv::norm(data.row(i)));
+    }
+
+    // The same seed gives the same model
+    cv::PCA again = aam::ComputePCA(data, retained_variance, options);
+    CHECK(cv::norm(again.eigenvectors, approx.eigenvectors, cv::NORM_INF) == 0);
+  }
+}
+
+int main() {
+  // Wide enough for more than one Gram column block
+  TestExactPCA(40, 1500, CV_64FC1, 1e-8);
+  TestExactPCA(40, 1500, CV_32FC1, 1e-3);
+  TestExactPCA(300, 50, CV_64FC1, 1e-8);
+  TestLeaveOneOut(CV_64FC1, 1e-8);
+  TestLeaveOneOut(CV_32FC1, 1e-3);
+  TestRandomizedPCA();
+  return aam_test::TestResult();
+}
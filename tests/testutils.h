@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+
+// Minimal checks for the test programs. A failed check is reported with its
+// location and the program keeps going, main returns TestResult().
+namespace aam_test {
+  inline int& failures() { static int n = 0; return n; }
+
+  inline int TestResult() {
+    if(failures() == 0) printf("All checks passed.\n");
+    else printf("%d checks failed.\n", failures());
+    return failures() == 0 ? 0 : 1;
+  }
+}
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++aam_test::failures(); \
+    } \
+  } while(0)
+
+#define CHECK_NEAR(a, b, tol) \
+  do { \
+    const double a_ = (a), b_ = (b); \
+    if(!(std::fabs(a_ - b_) <= (tol))) { \
+      fprintf(stderr, "%s:%d: check failed: %s = %.17g vs %s = %.17g, tolerance %g\n", \
+              __FILE__, __LINE__, #a, a_, #b, b_, double(tol)); \
+      ++aam_test::failures(); \
+    } \
+  } while(0)
@@ -0,0 +1,123 @@
+#include "texelindex.h"
+#include "utils.h"
+#include "testutils.h"
+
+using namespace std;
+
+namespace {
+  // Spans of random triangles, partly outside the frame and of both
+  // orientations, against the edge test of every pixel of the frame
+  void TestSpans() {
+    const cv::Size size(64, 48);
+    cv::RNG rng(1);
+    for(int t=0;t<500;++t) {
+      cv::Point2f v[3];
+      for(cv::Point2f& p : v) p = cv::Point2f(rng.uniform(-10.f, 74.f), rng.uniform(-10.f, 58.f));
+      // Integer vertices put pixels exactly on the edges
+      if(t % 4 == 0) for(cv::Point2f& p : v) p = cv::Point2f(std::round(p.x), std::round(p.y));
+
+      cv::Mat covered(size, CV_8UC1, cv::Scalar(0));
+      int last_row = -1;
+      aam::RasterizeTriangle(v[0], v[1], v[2], size, [&](int r, int c0, int c1) {
+        CHECK(r > last_row && r < size.height);
+        CHECK(0 <= c0 && c0 < c1 && c1 <= size.width);
+        last_row = r;
+        for(int c=c0;c<c1;++c) covered.at<unsigned char>(r, c) = 1;
+      });
+
+      const double area2 = (double(v[1].x) - v[0].x) * (double(v[2].y) - v[0].y) - (double(v[1].y) - v[0].y) * (double(v[2].x) - v[0].x);
+      const double orientation = area2 > 0 ? 1 : -1;
+      const aam::RasterEdge edges[3] = {aam::RasterEdge(v[0], v[1], orientation),
+                                        aam::RasterEdge(v[1], v[2], orientation),
+                                        aam::RasterEdge(v[2], v[0], orientation)};
+      int mismatches = 0;
+      for(int r=0;r<size.height;++r) {
+        for(int c=0;c<size.width;++c) {
+          const bool inside = area2 != 0 && edges[0].Inside(c, r) && edges[1].Inside(c, r) && edges[2].Inside(c, r);
+          if(inside != (covered.at<unsigned char>(r, c) != 0)) ++mismatches;
+        }
+      }
+      CHECK(mismatches == 0);
+    }
+  }
+
+  // Triangulated grid with integer vertices, jittered so the triangles have
+  // all orientations and edge slopes. The outer cells stick out of the
+  // frame, so the mesh covers all of it.
+  void MakeMesh(vector<cv::Point2f>& verts, vector<cv::Vec3i>& triangles) {
+    const int nx = 7, ny = 6, step = 20;
+    cv::RNG rng(3);
+    verts.clear();
+    for(int y=0;y<=ny;++y) {
+      for(int x=0;x<=nx;++x) {
+        verts.push_back(cv::Point2f(x * step - 10 + rng.uniform(-4, 5), y * step - 10 + rng.uniform(-4, 5)));
+      }
+    }
+
+    triangles.clear();
+    for(int y=0;y<ny;++y) {
+      for(int x=0;x<nx;++x) {
+        const int a = y * (nx + 1) + x, b = a + 1, c = a + nx + 1, d = c + 1;
+        triangles.push_back(cv::Vec3i(a, b, d));
+        triangles.push_back(cv::Vec3i(a, d, c));
+      }
+    }
+  }
+
+  // The texel index of a mesh against the label map the triangles used to
+  // be filled into
+  void TestMeshCoverage() {
+    const cv::Size size(120, 100);
+    vector<cv::Point2f> verts;
+    vector<cv::Vec3i> triangles;
+    MakeMesh(verts, triangles);
+    const int ntri = triangles.size();
+
+    aam::TexelIndex index;
+    index.Build(verts, triangles, size);
+    CHECK(index.IsValid(ntri, size));
+
+    // Every pixel of the frame belongs to exactly one triangle
+    cv::Mat owner(size, CV_32SC1, cv::Scalar(-1));
+    int shared = 0;
+    for(int j=0;j<ntri;++j) {
+      for(int k=index.offsets[j];k<index.offsets[j+1];++k) {
+        int& o = owner.at<int>(index.rows[k], index.cols[k]);
+        if(o >= 0) ++shared;
+        o = j;
+      }
+    }
+    CHECK(shared == 0);
+    CHECK(index.size() == size.area());
+
+    // The fill labels pixels on shared edges with the last triangle drawn
+    // and may reach a little past the edges, so only compare pixels inside
+    // a single triangle together with their 5 x 5 neighbourhood
+    cv::Mat labels(size, CV_32SC1, cv::Scalar(-1));
+    for(int j=0;j<ntri;++j) {
+      aam::FillTriangle(labels, verts[triangles[j][0]], verts[triangles[j][1]], verts[triangles[j][2]], cv::Scalar(j));
+    }
+
+    int compared = 0, mismatches = 0;
+    for(int r=2;r<size.height-2;++r) {
+      for(int c=2;c<size.width-2;++c) {
+        const int label = labels.at<int>(r, c);
+        bool interior = label >= 0;
+        for(int dr=-2;dr<=2 && interior;++dr) {
+          for(int dc=-2;dc<=2 && interior;++dc) interior = labels.at<int>(r + dr, c + dc) == label;
+        }
+        if(!interior) continue;
+        ++compared;
+        if(owner.at<int>(r, c) != label) ++mismatches;
+      }
+    }
+    CHECK(compared > size.area() / 8);
+    CHECK(mismatches == 0);
+  }
+}
+
+int main() {
+  TestSpans();
+  TestMeshCoverage();
+  return aam_test::TestResult();
+}
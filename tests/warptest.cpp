@@ -0,0 +1,73 @@
+#include "warp.h"
+#include "testutils.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace {
+  // Random 3-channel image of the given depth, 8-bit images span [0, 255]
+  // and floating point ones [0, 1]
+  cv::Mat MakeImage(int depth, cv::Size size, cv::RNG& rng) {
+    cv::Mat img(size, CV_MAKETYPE(depth, 3));
+    if(depth == CV_8U) rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+    else rng.fill(img, cv::RNG::UNIFORM, 0, 1);
+    return img;
+  }
+
+  // Samples img at n positions with the given kernel
+  template <typename T>
+  vector<T> Warp(aam::WarpKernel kernel, const cv::Mat& img, const aam::Affine2f& tform,
+                 const vector<float>& xs, const vector<float>& ys) {
+    aam::SetWarpKernel(kernel);
+    vector<T> out(xs.size() * 3);
+    aam::WarpTexels<T>(img, tform, xs.data(), ys.data(), xs.size(), out.data());
+    return out;
+  }
+
+  // The AVX2 kernels against the scalar ones, bit for bit. The positions
+  // cover the whole image and a margin around it, so some neighbourhoods
+  // leave the image, and the counts are not all multiples of 8, so the
+  // tails go through the scalar code within the AVX2 path.
+  template <typename T>
+  void TestKernelsAgree(int depth) {
+    cv::RNG rng(depth + 1);
+    const int counts[] = {0, 1, 7, 8, 9, 15, 16, 17, 31, 1000, 1003};
+    for(int trial=0;trial<20;++trial) {
+      const cv::Size size(rng.uniform(2, 80), rng.uniform(2, 60));
+      cv::Mat img = MakeImage(depth, size, rng);
+      // Every other image is a view with padded rows
+      if(trial % 2) img = MakeImage(depth, cv::Size(size.width + 5, size.height), rng).colRange(2, 2 + size.width);
+
+      aam::Affine2f tform;
+      tform.m00 = rng.uniform(0.5f, 1.5f); tform.m01 = rng.uniform(-0.3f, 0.3f); tform.m02 = rng.uniform(-3.f, 3.f);
+      tform.m10 = rng.uniform(-0.3f, 0.3f); tform.m11 = rng.uniform(0.5f, 1.5f); tform.m12 = rng.uniform(-3.f, 3.f);
+
+      for(int n : counts) {
+        vector<float> xs(n), ys(n);
+        for(int k=0;k<n;++k) {
+          xs[k] = rng.uniform(-4.f, size.width + 4.f);
+          ys[k] = rng.uniform(-4.f, size.height + 4.f);
+        }
+
+        vector<T> scalar = Warp<T>(aam::WarpKernel::Scalar, img, tform, xs, ys);
+        vector<T> avx2 = Warp<T>(aam::WarpKernel::AVX2, img, tform, xs, ys);
+        CHECK(memcmp(scalar.data(), avx2.data(), scalar.size() * sizeof(T)) == 0);
+      }
+    }
+  }
+}
+
+int main() {
+  if(!aam::SetWarpKernel(aam::WarpKernel::AVX2)) {
+    printf("No AVX2 warp kernel on this build or CPU, nothing to compare.\n");
+    return 0;
+  }
+
+  TestKernelsAgree<float>(CV_32F);
+  TestKernelsAgree<double>(CV_64F);
+  TestKernelsAgree<float>(CV_8U);
+  TestKernelsAgree<double>(CV_8U);
+  aam::SetWarpKernel(aam::WarpKernel::Auto);
+  return aam_test::TestResult();
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.h"
+
+#include <cmath>
+
+namespace aam {
+
+  // Edge of a triangle for RasterizeTriangle. The edge function is always
+  // evaluated from the endpoints in a canonical order, so a pixel on an edge
+  // shared by two triangles gets exactly the same value in both of them.
+  struct RasterEdge {
+    double ax, ay, dx, dy;  //!< canonical start point and direction
+    double s;               //!< side of the canonical edge the triangle lies on, +1 or -1
+
+    RasterEdge(const cv::Point2f& p, const cv::Point2f& q, double orientation) {
+      const bool swapped = q.x < p.x || (q.x == p.x && q.y < p.y);
+      const cv::Point2f& a = swapped ? q : p;
+      const cv::Point2f& b = swapped ? p : q;
+      ax = a.x; ay = a.y;
+      dx = b.x - a.x; dy = b.y - a.y;
+      s = swapped ? -orientation : orientation;
+    }
+
+    // Points exactly on the edge go to the triangle on its positive side,
+    // so the triangles of a mesh never share a pixel
+    bool Inside(double x, double y) const {
+      const double e = dx * (y - ay) - dy * (x - ax);
+      return s > 0 ? e >= 0 : e < 0;
+    }
+  };
+
+  // Calls emit(row, col_begin, col_end) for every horizontal span of integer
+  // pixel positions inside the triangle (v0, v1, v2), clipped to size, from
+  // the top row down. The cost is proportional to the triangle area.
+  template <typename F>
+  void RasterizeTriangle(const cv::Point2f& v0, const cv::Point2f& v1, const cv::Point2f& v2,
+                         cv::Size size, F emit) {
+    const double area2 = (double(v1.x) - v0.x) * (double(v2.y) - v0.y) - (double(v1.y) - v0.y) * (double(v2.x) - v0.x);
+    if(area2 == 0) return;
+
+    const double orientation = area2 > 0 ? 1 : -1;
+    const RasterEdge edges[3] = {RasterEdge(v0, v1, orientation),
+                                 RasterEdge(v1, v2, orientation),
+                                 RasterEdge(v2, v0, orientation)};
+    auto inside = [&](int x, int y) {
+      return edges[0].Inside(x, y) && edges[1].Inside(x, y) && edges[2].Inside(x, y);
+    };
+
+    const double xmin = std::min({v0.x, v1.x, v2.x}), xmax = std::max({v0.x, v1.x, v2.x});
+    const double ymin = std::min({v0.y, v1.y, v2.y}), ymax = std::max({v0.y, v1.y, v2.y});
+    const int cmin = std::max(0.0, std::ceil(xmin)), cmax = std::min(size.width - 1.0, std::floor(xmax));
+    const int rmin = std::max(0.0, std::ceil(ymin)), rmax = std::min(size.height - 1.0, std::floor(ymax));
+
+    for(int r=rmin;r<=rmax;++r) {
+      // Intersect the row with the half plane of each edge
+      double lo = cmin, hi = cmax;
+      for(const RasterEdge& e : edges) {
+        if(e.dy == 0) continue;  // horizontal edges are settled by the exact test below
+        const double x = e.ax + e.dx * (r - e.ay) / e.dy;
+        if(e.s * e.dy < 0) lo = std::max(lo, std::ceil(x));
+        else hi = std::min(hi, std::floor(x));
+      }
+
+      // The bounds may be off by one through rounding and ties, widen them
+      // and settle the ends with the exact inside test
+      int c0 = std::max<double>(cmin, lo - 1), c1 = std::min<double>(cmax, hi + 1);
+      while(c0 <= c1 && !inside(c0, r)) ++c0;
+      while(c1 >= c0 && !inside(c1, r)) --c1;
+      if(c0 <= c1) emit(r, c0, c1 + 1);
+    }
+  }
+
+  // Pixels covered by each triangle of a mesh, stored as flat arrays in CSR
+  // layout: the texels of triangle j are [offsets[j], offsets[j+1]). Texels of
+  // a triangle are in row-major order and triangles follow each other, which
+  // is also the layout of a texture vector, so texel k is element k of it.
+  struct TexelIndex {
+    std::vector<int> offsets;     //!< ntriangles + 1 prefix sums of the texel counts
+    std::vector<int> rows, cols;  //!< pixel coordinates of each texel
+    std::vector<float> xs, ys;    //!< cols and rows as floats, input to the warps
+    std::vector<float> w0, w1;    //!< barycentric coordinates, see ComputeBarycentrics
+
+    int ntriangles() const { return offsets.empty() ? 0 : static_cast<int>(offsets.size()) - 1; }
+    int size() const { return rows.size(); }
+    int count(int j) const { return offsets[j+1] - offsets[j]; }
+
+    // Rasterizes every triangle of the mesh, with vertices verts, in a
+    // frame of the given size
+    void Build(const std::vector<cv::Point2f>& verts,
+               const std::vector<cv::Vec3i>& triangles,
+               cv::Size size) {
+      const int ntri = triangles.size();
+      offsets.resize(ntri + 1);
+      rows.clear();
+      cols.clear();
+      for(int j=0;j<ntri;++j) {
+        offsets[j] = rows.size();
+        RasterizeTriangle(verts[triangles[j][0]], verts[triangles[j][1]], verts[triangles[j][2]], size,
+                          [&](int r, int c0, int c1) {
+                            rows.insert(rows.end(), c1 - c0, r);
+                            for(int c=c0;c<c1;++c) cols.push_back(c);
+                          });
+      }
+      offsets[ntri] = rows.size();
+
+      UpdateCoordinates();
+    }
+
+    // Barycentric coordinates of every texel with respect to its triangle in
+    // verts, the mesh the index was rasterized from. The texel then maps to
+    // w0 * v0 + w1 * v1 + (1 - w0 - w1) * v2 in any other shape.
+    void ComputeBarycentrics(const std::vector<cv::Point2f>& verts,
+                             const std::vector<cv::Vec3i>& triangles) {
+      w0.resize(size());
+      w1.resize(size());
+      for(int j=0;j<ntriangles();++j) {
+        const cv::Point2d a = verts[triangles[j][0]], b = verts[triangles[j][1]], c = verts[triangles[j][2]];
+        const double det = (b.y - c.y) * (a.x - c.x) + (c.x - b.x) * (a.y - c.y);
+        const double inv_det = det != 0 ? 1.0 / det : 0.0;
+
+        for(int k=offsets[j];k<offsets[j+1];++k) {
+          const double dx = cols[k] - c.x, dy = rows[k] - c.y;
+          w0[k] = ((b.y - c.y) * dx + (c.x - b.x) * dy) * inv_det;
+          w1[k] = ((c.y - a.y) * dx + (a.x - c.x) * dy) * inv_det;
+        }
+      }
+    }
+
+    // Whether offsets, rows and cols filled directly, e.g. from a file, form
+    // a valid index of ntri triangles in a frame of the given size: offsets
+    // start at 0, never decrease and end at the texel count, and every texel
+    // lies inside the frame
+    bool IsValid(int ntri, cv::Size size) const {
+      if(static_cast<int>(offsets.size()) != ntri + 1 || offsets[0] != 0) return false;
+      for(int j=0;j<ntri;++j) {
+        if(offsets[j+1] < offsets[j]) return false;
+      }
+      if(size_t(offsets[ntri]) != rows.size() || rows.size() != cols.size()) return false;
+      for(size_t k=0;k<rows.size();++k) {
+        if(rows[k] < 0 || rows[k] >= size.height || cols[k] < 0 || cols[k] >= size.width) return false;
+      }
+      return true;
+    }
+
+    // Refreshes xs and ys after rows and cols were filled directly
+    void UpdateCoordinates() {
+      xs.assign(cols.begin(), cols.end());
+      ys.assign(rows.begin(), rows.end());
+    }
+  };
+
+}
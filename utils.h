@@ -1,6 +1,8 @@
 #pragma once
 
 #include "common.h"
+#include "procrustes.h"
+#include "texelindex.h"
 
 namespace aam {
 
@@ -14,33 +16,80 @@ namespace aam {
     return pairs;
   }
 
-  inline cv::Mat QImage2CVMat(const QImage& img) {
-    cv::Mat mat(img.width(), img.height(), CV_64FC3, cv::Scalar(0));
+  // Wraps the pixel buffer of img in a cv::Mat header without copying. Only
+  // 8-bit formats whose memory layout OpenCV can address directly are wrapped:
+  //   RGB32/ARGB32 -> CV_8UC4, stored as BGRA on little endian hosts
+  //   RGB888       -> CV_8UC3, stored as RGB
+  //   Grayscale8   -> CV_8UC1
+  // An empty Mat is returned for any other format. The returned Mat is only
+  // valid as long as img is alive and unmodified.
+  inline cv::Mat QImage2CVMatView(const QImage& img) {
+    if(img.isNull()) return cv::Mat();
+
+    // constBits() does not detach, so this is a view on the shared buffer
+    void* bits = const_cast<uchar*>(img.constBits());
+    const size_t step = img.bytesPerLine();
+
+    switch(img.format()) {
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+      case QImage::Format_RGB32:
+      case QImage::Format_ARGB32:
+      case QImage::Format_ARGB32_Premultiplied:
+        return cv::Mat(img.height(), img.width(), CV_8UC4, bits, step);
+#endif
+      case QImage::Format_RGB888:
+        return cv::Mat(img.height(), img.width(), CV_8UC3, bits, step);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+      case QImage::Format_Grayscale8:
+        return cv::Mat(img.height(), img.width(), CV_8UC1, bits, step);
+#endif
+      default:
+        return cv::Mat();
+    }
+  }
 
-    for(int i=0;i<img.height();++i) {
-      for(int j=0;j<img.width();++j) {
-        auto pij = img.pixel(j, i);
+  // Swizzles a view returned by QImage2CVMatView into 8-bit BGR. cv::cvtColor
+  // runs vectorized row kernels and reuses bgr if it is already allocated.
+  inline void CVMatView2BGR(const cv::Mat& view, cv::Mat& bgr) {
+    switch(view.channels()) {
+      case 4: cv::cvtColor(view, bgr, cv::COLOR_BGRA2BGR); break;
+      case 3: cv::cvtColor(view, bgr, cv::COLOR_RGB2BGR); break;
+      default: cv::cvtColor(view, bgr, cv::COLOR_GRAY2BGR); break;
+    }
+  }
 
-        // OpenCV uses BGR format, while QImage is RGB
-        cv::Vec3d pix(qBlue(pij) / 255.0, qGreen(pij) / 255.0, qRed(pij) / 255.0);
-        mat.at<cv::Vec3d>(i, j) = pix;
-      }
+  inline cv::Mat QImage2CVMatU(const QImage& img) {
+    cv::Mat view = QImage2CVMatView(img);
+    if(view.empty()) {
+      if(img.isNull()) return cv::Mat();
+
+      // Indexed, 16-bit, ... formats: let Qt expand them to a layout we can wrap
+      return QImage2CVMatU(img.convertToFormat(QImage::Format_RGB888));
     }
 
+    // OpenCV uses BGR format, while QImage is RGB
+    cv::Mat mat;
+    CVMatView2BGR(view, mat);
     return mat;
   }
 
-  inline cv::Mat QImage2CVMatU(const QImage& img) {
-    cv::Mat mat(img.width(), img.height(), CV_8UC3, cv::Scalar(0));
+  // Converts img to a 3-channel BGR cv::Mat of scalar type T in [0, 1]
+  template <typename T = double>
+  cv::Mat QImage2CVMat(const QImage& img) {
+    cv::Mat view = QImage2CVMatView(img);
+    if(view.empty()) {
+      if(img.isNull()) return cv::Mat();
+      return QImage2CVMat<T>(img.convertToFormat(QImage::Format_RGB888));
+    }
 
+    // Convert one scanline at a time so the 8-bit BGR row stays in cache
+    // between the channel swizzle and the scaling to [0, 1]
+    cv::Mat mat(img.height(), img.width(), CV_MAKETYPE(cv::DataType<T>::depth, 3));
+    cv::Mat bgr_row(1, img.width(), CV_8UC3);
     for(int i=0;i<img.height();++i) {
-      for(int j=0;j<img.width();++j) {
-        auto pij = img.pixel(j, i);
-
-        // OpenCV uses BGR format, while QImage is RGB
-        cv::Vec3b pix(qBlue(pij), qGreen(pij), qRed(pij));
-        mat.at<cv::Vec3b>(i, j) = pix;
-      }
+      CVMatView2BGR(view.row(i), bgr_row);
+      cv::Mat mat_row = mat.row(i);
+      bgr_row.convertTo(mat_row, cv::DataType<T>::depth, 1.0 / 255.0);
     }
 
     return mat;
@@ -113,12 +162,31 @@ namespace aam {
 
   inline void PAUSE() { getchar(); }
 
-  inline std::vector<cv::Point2f> CVMat2Points(const cv::Mat& m) {
+  // 64-bit FNV-1a hash. Pass the previous result as seed to hash several
+  // buffers in sequence.
+  inline uint64_t HashBytes(const void* data, size_t size,
+                            uint64_t seed = 14695981039346656037ULL) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed;
+    for(size_t i=0;i<size;++i) {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  // Into points, reusing its storage
+  inline void CVMat2Points(const cv::Mat& m, std::vector<cv::Point2f>& points) {
     const int npoints = m.cols/2;
-    std::vector<cv::Point2f> points(npoints);
+    points.resize(npoints);
     for(int i=0;i<npoints;++i) {
       points[i] = cv::Point2f(m.at<double>(0,i*2), m.at<double>(0, i*2+1));
     }
+  }
+
+  inline std::vector<cv::Point2f> CVMat2Points(const cv::Mat& m) {
+    std::vector<cv::Point2f> points;
+    CVMat2Points(m, points);
     return points;
   }
 
@@ -128,90 +196,43 @@ namespace aam {
     return v;
   }
 
+  // Similarity transform from from_shape to to_shape as a 2x3 matrix. Hot
+  // loops should call EstimateSimilarity directly and skip the cv::Mat.
   inline cv::Mat EstimateRigidTransform(const cv::Mat& from_shape,
                                         const cv::Mat& to_shape) {
-    Eigen::VectorXd p = CVMat2EigenVec(from_shape);
-    Eigen::VectorXd q = CVMat2EigenVec(to_shape);
-
-    assert(p.rows() == q.rows());
-
-    int n = p.rows() / 2;
-    assert(n>0);
-    const int m = 2;
-
-    Eigen::Map<const Eigen::MatrixXd> pmatT(p.data(), 2, n);
-    Eigen::Map<const Eigen::MatrixXd> qmatT(q.data(), 2, n);
-
-    Eigen::MatrixXd pmat = pmatT.transpose();
-    Eigen::MatrixXd qmat = qmatT.transpose();
-
-    Eigen::MatrixXd mu_p = pmat.colwise().mean();
-    Eigen::MatrixXd mu_q = qmat.colwise().mean();
-
-    Eigen::MatrixXd dp = pmat - mu_p.replicate(n, 1);
-    Eigen::MatrixXd dq = qmat - mu_q.replicate(n, 1);
-
-    double sig_p2 = dp.squaredNorm() / n;
-    double sig_q2 = dq.squaredNorm() / n;
-
-    Eigen::MatrixXd sig_pq = dq.transpose() * dp / n;
-
-    double det_sig_pq = sig_pq.determinant();
-    Eigen::MatrixXd S = Eigen::MatrixXd::Identity(m, m);
-    if (det_sig_pq < 0) S(m - 1, m - 1) = -1;
-
-    Eigen::MatrixXd U, V;
-    Eigen::VectorXd D;
-
-    Eigen::JacobiSVD<Eigen::MatrixXd> svd(sig_pq, Eigen::ComputeFullU | Eigen::ComputeFullV);
-    D = svd.singularValues();
-    U = svd.matrixU();
-    V = svd.matrixV();
-
-    Eigen::MatrixXd R = U * S * V.transpose();
-
-    Eigen::Matrix2d Dmat;
-    Dmat << D[0], 0, 0, D[1];
-
-    double s = (Dmat * S).trace() / sig_p2;
-
-    Eigen::VectorXd t = mu_q.transpose() - s * R * mu_p.transpose();
-
-    R = R * s;
-
-    cv::Mat tform(2, 3, CV_64FC1);
-    tform.at<double>(0, 0) = R(0, 0); tform.at<double>(0, 1) = R(0, 1);
-    tform.at<double>(1, 0) = R(1, 0); tform.at<double>(1, 1) = R(1, 1);
-
-    tform.at<double>(0, 2) = t(0); tform.at<double>(1, 2) = t(1);
-    return tform;
+    assert(from_shape.cols == to_shape.cols);
+    assert(from_shape.isContinuous() && to_shape.isContinuous());
+    return EstimateSimilarity(from_shape.ptr<double>(0),
+                              to_shape.ptr<double>(0),
+                              from_shape.cols / 2).ToMat();
   }
 
-  inline cv::Vec3d SampleImage(const cv::Mat& I, const cv::Point2f& p) {
+  template <typename T = double>
+  cv::Vec<T, 3> SampleImage(const cv::Mat& I, const cv::Point2f& p) {
+    typedef cv::Vec<T, 3> Pixel;
+
     int x0 = p.x, y0 = p.y;
     int x1 = x0 + 1, y1 = y0 + 1;
 
-    if(x0 < 0 || y0 < 0 || x1 >= I.cols || y1 >= I.rows) return cv::Vec3d(0, 0, 0);
+    if(x0 < 0 || y0 < 0 || x1 >= I.cols || y1 >= I.rows) return Pixel(0, 0, 0);
 
     //bilinear interpolation
     float dx = p.x - x0;
     float dy = p.y - y0;
 
-    return I.at<cv::Vec3d>(y0, x0) * (1.0 - dx) * (1.0 - dy)
-           + I.at<cv::Vec3d>(y0, x1) * (dx)       * (1.0 - dy)
-           + I.at<cv::Vec3d>(y1, x0) * (1.0 - dx) * (dy)
-           + I.at<cv::Vec3d>(y1, x1) * (dx)       * (dy);
+    return I.at<Pixel>(y0, x0) * (1.0 - dx) * (1.0 - dy)
+           + I.at<Pixel>(y0, x1) * (dx)       * (1.0 - dy)
+           + I.at<Pixel>(y1, x0) * (1.0 - dx) * (dy)
+           + I.at<Pixel>(y1, x1) * (dx)       * (dy);
   }
 
-  inline void FillImage(const cv::Mat& tex,
-                        const std::vector<std::vector<cv::Vec2i>>& pixel_coords,
+  template <typename T = double>
+  void FillImage(const cv::Mat& tex,
+                        const TexelIndex& index,
                         cv::Mat& img) {
-    for(int j=0, offset=0;j<pixel_coords.size();++j) {
-      for(int k=0; k<pixel_coords[j].size(); ++k) {
-        auto pix = pixel_coords[j][k];
-        img.at<cv::Vec3d>(pix[0], pix[1]) = tex.at<cv::Vec3d>(0, offset+k);
-      }
-      offset += pixel_coords[j].size();
+    const cv::Vec<T, 3>* t = tex.ptr<cv::Vec<T, 3>>(0);
+    for(int k=0;k<index.size();++k) {
+      img.at<cv::Vec<T, 3>>(index.rows[k], index.cols[k]) = t[k];
     }
   }
 
@@ -219,64 +240,79 @@ namespace aam {
     std::cout << "[" << m.rows << 'x' << m.cols << 'x' << m.channels() << "]" << std::endl;
   }
 
-  inline std::tuple<cv::Mat, double, cv::Mat> NormalizeTextureVec(const cv::Mat& v, const cv::Mat& ref) {
-    cv::Mat u = v.clone();
-    u = u.reshape(1).reshape(1, 3);  // split the rows
-
-    double alpha = ref.dot(v);
-
-    // compute row mean
-    cv::Mat mean;
-    cv::reduce(u, mean, 1, CV_REDUCE_AVG);
-
-    cv::Mat beta;
-    cv::repeat(mean, 1, v.cols, beta);
-
-    cv::Mat normalized = (u - beta) / alpha;
-    normalized = normalized.reshape(3, 1);
+  // Normalizes the texture vector v of n scalars against the reference ref,
+  // with one read pass and one write pass and no temporaries:
+  //   out = (v - beta) / alpha,  alpha = ref . v
+  // The scalars are split into three consecutive segments of n / 3 and
+  // beta[s] is the mean of segment s. out may be v. Returns alpha.
+  template <typename T>
+  double NormalizeTexture(const T* v, const T* ref, int n, T* out, double beta[3]) {
+    const int m = n / 3;
+    double alpha = 0;
+    for(int s=0;s<3;++s) {
+      const T* vs = v + s * m;
+      const T* rs = ref + s * m;
+      double sum = 0;
+      for(int k=0;k<m;++k) {
+        sum += vs[k];
+        alpha += static_cast<double>(rs[k]) * vs[k];
+      }
+      beta[s] = sum / m;
+    }
 
-    return std::make_tuple(normalized, alpha, beta);
+    const double inv_alpha = 1.0 / alpha;
+    for(int s=0;s<3;++s) {
+      const T* vs = v + s * m;
+      T* os = out + s * m;
+      const double b = beta[s];
+      for(int k=0;k<m;++k) os[k] = (vs[k] - b) * inv_alpha;
+    }
+    return alpha;
   }
 
-  inline cv::Mat WarpImage(const cv::Mat& img,
-                           const std::vector<cv::Mat>& tforms,
-                           const std::vector<cv::Mat>& pixel_mats,
-                           const std::vector<std::vector<cv::Vec2i>>& pixel_coords) {
-    const int h = img.rows, w = img.cols;
-    cv::Mat warped(h, w, CV_64FC3, cv::Scalar(0, 0, 0));
-    const int ntriangles = tforms.size();
-
-    for(int j=0;j<ntriangles;++j) {
-      // project back the points to input image space
-      if(pixel_mats[j].rows == 0) continue;
-
-      cv::Mat pts;
-      cv::transform(pixel_mats[j].reshape(2), pts, tforms[j]);
-      pts = pts.reshape(1, 1);
-
-      for(int k=0;k<pixel_coords[j].size();++k) {
-        auto pix_coord = pixel_coords[j][k];
-
-        cv::Vec3d sample = SampleImage(img, cv::Point2f(pts.at<float>(0,k*2), pts.at<float>(0,k*2+1)));
-
-        warped.at<cv::Vec3d>(pix_coord[0], pix_coord[1]) = sample;
-      }
+  // Inverse of NormalizeTexture: out = v * alpha + beta, out may be v
+  template <typename T>
+  void DenormalizeTexture(const T* v, int n, double alpha, const double beta[3], T* out) {
+    const int m = n / 3;
+    for(int s=0;s<3;++s) {
+      const T* vs = v + s * m;
+      T* os = out + s * m;
+      const double b = beta[s];
+      for(int k=0;k<m;++k) os[k] = vs[k] * alpha + b;
     }
+  }
 
-    return warped;
+  // NormalizeTexture on continuous 1 x ntexels 3-channel rows of scalar type
+  // T. out is allocated if needed and may be v or a row of a texture matrix.
+  template <typename T = double>
+  double NormalizeTextureVec(const cv::Mat& v, const cv::Mat& ref, cv::Mat& out, cv::Vec3d& beta) {
+    assert(v.isContinuous() && ref.isContinuous() && v.total() == ref.total());
+    out.create(v.rows, v.cols, v.type());
+    return NormalizeTexture(v.ptr<T>(0), ref.ptr<T>(0), v.cols * 3, out.ptr<T>(0), beta.val);
   }
 
-  inline double ComputeRMSE(const cv::Mat& I1, const cv::Mat& I2, const std::vector<std::vector<cv::Vec2i>>& pixel_coords) {
+  // DenormalizeTexture on a continuous 3-channel row, in place
+  template <typename T = double>
+  void DenormalizeTextureVec(cv::Mat& v, double alpha, const cv::Vec3d& beta) {
+    assert(v.isContinuous());
+    DenormalizeTexture(v.ptr<T>(0), v.cols * 3, alpha, beta.val, v.ptr<T>(0));
+  }
+
+  // I2 may also be an 8-bit image, its values are then scaled to [0, 1]
+  // like QImage2CVMat does
+  template <typename T = double>
+  double ComputeRMSE(const cv::Mat& I1, const cv::Mat& I2, const TexelIndex& index) {
+    const bool I2_8u = I2.depth() == CV_8U;
     double e = 0;
-    int count = 0;
-    for(auto coords : pixel_coords) {
-      count += coords.size();
-      for(auto p : coords) {
-        cv::Vec3d diff = I1.at<cv::Vec3d>(p[0], p[1]) - I2.at<cv::Vec3d>(p[0], p[1]);
-        e += diff.dot(diff);
-      }
+    for(int k=0;k<index.size();++k) {
+      const int r = index.rows[k], c = index.cols[k];
+      // accumulate in double precision regardless of T
+      const cv::Vec3d p2 = I2_8u ? cv::Vec3d(I2.at<cv::Vec3b>(r, c)) * (1.0 / 255.0)
+                                 : cv::Vec3d(I2.at<cv::Vec<T, 3>>(r, c));
+      cv::Vec3d diff = cv::Vec3d(I1.at<cv::Vec<T, 3>>(r, c)) - p2;
+      e += diff.dot(diff);
     }
 
-    return sqrt(e / count);
+    return sqrt(e / index.size());
   }
 }
@@ -0,0 +1,340 @@
+#include "warp.h"
+
+#include <atomic>
+
+// Keep every multiply and add separate, see WarpTexels. GCC does not know
+// this pragma, the build passes -ffp-contract=off for this file instead.
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AAM_WARP_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace aam {
+
+  namespace {
+    // Image layout shared by the kernels, step is in elements
+    template <typename T>
+    struct ImageView {
+      const T* data;
+      int rows, cols;
+      int step;
+    };
+
+    template <typename T>
+    ImageView<T> make_view(const cv::Mat& img) {
+      assert(img.type() == CV_MAKETYPE(cv::DataType<T>::depth, 3));
+      ImageView<T> v;
+      v.data = img.ptr<T>(0);
+      v.rows = img.rows;
+      v.cols = img.cols;
+      v.step = img.step1();
+      return v;
+    }
+
+    // Reference kernel. The weights are computed in T from the single
+    // precision fractions and the corners are summed in a fixed order, the
+    // AVX2 kernels follow the same recipe.
+    template <typename T>
+    void warp_texels_scalar(const ImageView<T>& img, const Affine2f& a,
+                            const float* xs, const float* ys, int n, T* out) {
+      for(int k=0;k<n;++k, out+=3) {
+        const float x = a.m00 * xs[k] + a.m01 * ys[k] + a.m02;
+        const float y = a.m10 * xs[k] + a.m11 * ys[k] + a.m12;
+        const int x0 = x, y0 = y;
+
+        if(x0 < 0 || y0 < 0 || x0 + 1 >= img.cols || y0 + 1 >= img.rows) {
+          out[0] = out[1] = out[2] = 0;
+          continue;
+        }
+
+        const T dx = x - x0, dy = y - y0;
+        const T w00 = (1 - dx) * (1 - dy), w01 = dx * (1 - dy);
+        const T w10 = (1 - dx) * dy, w11 = dx * dy;
+
+        const T* p0 = img.data + y0 * img.step + x0 * 3;
+        const T* p1 = p0 + img.step;
+        for(int c=0;c<3;++c) {
+          out[c] = p0[c] * w00 + p0[c+3] * w01 + p1[c] * w10 + p1[c+3] * w11;
+        }
+      }
+    }
+
+    // 8-bit images are interpolated in fixed point: the fractions become
+    // 8-bit weights, the horizontal pass yields 16-bit values and the
+    // vertical pass 24-bit ones, which are scaled to [0, 1] like
+    // QImage2CVMat does only when they are written out.
+    const int frac_bits = 8;
+    const int frac_one = 1 << frac_bits;
+
+    template <typename T>
+    void warp_texels_8u_scalar(const ImageView<uchar>& img, const Affine2f& a,
+                               const float* xs, const float* ys, int n, T* out) {
+      const T scale = T(1.0 / (255.0 * frac_one * frac_one));
+      for(int k=0;k<n;++k, out+=3) {
+        const float x = a.m00 * xs[k] + a.m01 * ys[k] + a.m02;
+        const float y = a.m10 * xs[k] + a.m11 * ys[k] + a.m12;
+        const int x0 = x, y0 = y;
+
+        if(x0 < 0 || y0 < 0 || x0 + 1 >= img.cols || y0 + 1 >= img.rows) {
+          out[0] = out[1] = out[2] = 0;
+          continue;
+        }
+
+        const int wx = (x - x0) * float(frac_one) + 0.5f;
+        const int wy = (y - y0) * float(frac_one) + 0.5f;
+
+        const uchar* p0 = img.data + y0 * img.step + x0 * 3;
+        const uchar* p1 = p0 + img.step;
+        for(int c=0;c<3;++c) {
+          const int top = p0[c] * (frac_one - wx) + p0[c+3] * wx;
+          const int bottom = p1[c] * (frac_one - wx) + p1[c+3] * wx;
+          out[c] = T((top << frac_bits) + (bottom - top) * wy) * scale;
+        }
+      }
+    }
+
+#ifdef AAM_WARP_AVX2
+    bool cpu_has_avx2() {
+      static const bool supported = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+      }();
+      return supported;
+    }
+
+    std::atomic<bool> use_avx2(cpu_has_avx2());
+
+    // Common front end for 8 texels: transforms the positions, splits them
+    // into integer corners and fractions and computes the element offset of
+    // the top left corner. Lanes whose 2x2 neighbourhood leaves the image
+    // are cleared in valid, the gathers skip them.
+    struct Lanes {
+      __m256 dx, dy;
+      __m256i offset, valid;
+    };
+
+    __attribute__((target("avx2")))
+    inline Lanes transform_lanes(const Affine2f& a, const float* xs, const float* ys,
+                                 int rows, int cols, int step) {
+      const __m256 x = _mm256_loadu_ps(xs), y = _mm256_loadu_ps(ys);
+      // same operation order as the scalar kernel, no fused multiply-add
+      const __m256 px = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(a.m00), x),
+                                                    _mm256_mul_ps(_mm256_set1_ps(a.m01), y)),
+                                      _mm256_set1_ps(a.m02));
+      const __m256 py = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(a.m10), x),
+                                                    _mm256_mul_ps(_mm256_set1_ps(a.m11), y)),
+                                      _mm256_set1_ps(a.m12));
+
+      // truncation towards zero, out of range values become INT_MIN
+      const __m256i x0 = _mm256_cvttps_epi32(px), y0 = _mm256_cvttps_epi32(py);
+
+      const __m256i zero = _mm256_setzero_si256();
+      const __m256i invalid = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpgt_epi32(zero, x0), _mm256_cmpgt_epi32(x0, _mm256_set1_epi32(cols - 2))),
+        _mm256_or_si256(_mm256_cmpgt_epi32(zero, y0), _mm256_cmpgt_epi32(y0, _mm256_set1_epi32(rows - 2))));
+
+      Lanes l;
+      l.dx = _mm256_sub_ps(px, _mm256_cvtepi32_ps(x0));
+      l.dy = _mm256_sub_ps(py, _mm256_cvtepi32_ps(y0));
+      l.offset = _mm256_add_epi32(_mm256_mullo_epi32(y0, _mm256_set1_epi32(step)),
+                                  _mm256_mullo_epi32(x0, _mm256_set1_epi32(3)));
+      l.valid = _mm256_xor_si256(invalid, _mm256_set1_epi32(-1));
+      return l;
+    }
+
+    __attribute__((target("avx2")))
+    void warp_texels_avx2(const ImageView<float>& img, const Affine2f& a,
+                          const float* xs, const float* ys, int n, float* out) {
+      const __m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+      alignas(32) float planes[3][8];
+
+      int k = 0;
+      for(;k+8<=n;k+=8, out+=24) {
+        const Lanes l = transform_lanes(a, xs + k, ys + k, img.rows, img.cols, img.step);
+
+        const __m256 w00 = _mm256_mul_ps(_mm256_sub_ps(one, l.dx), _mm256_sub_ps(one, l.dy));
+        const __m256 w01 = _mm256_mul_ps(l.dx, _mm256_sub_ps(one, l.dy));
+        const __m256 w10 = _mm256_mul_ps(_mm256_sub_ps(one, l.dx), l.dy);
+        const __m256 w11 = _mm256_mul_ps(l.dx, l.dy);
+
+        for(int c=0;c<3;++c) {
+          const float* p0 = img.data + c;
+          const float* p1 = p0 + img.step;
+          const __m256 valid = _mm256_castsi256_ps(l.valid);
+          const __m256 g00 = _mm256_mask_i32gather_ps(zero, p0, l.offset, valid, 4);
+          const __m256 g01 = _mm256_mask_i32gather_ps(zero, p0 + 3, l.offset, valid, 4);
+          const __m256 g10 = _mm256_mask_i32gather_ps(zero, p1, l.offset, valid, 4);
+          const __m256 g11 = _mm256_mask_i32gather_ps(zero, p1 + 3, l.offset, valid, 4);
+          __m256 s = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(g00, w00),
+                                                               _mm256_mul_ps(g01, w01)),
+                                                 _mm256_mul_ps(g10, w10)),
+                                   _mm256_mul_ps(g11, w11));
+          // the weights of invalid lanes may be NaN
+          s = _mm256_and_ps(valid, s);
+          _mm256_store_ps(planes[c], s);
+        }
+
+        // back to interleaved BGR
+        for(int t=0;t<8;++t) {
+          out[t*3] = planes[0][t];
+          out[t*3+1] = planes[1][t];
+          out[t*3+2] = planes[2][t];
+        }
+      }
+
+      warp_texels_scalar(img, a, xs + k, ys + k, n - k, out);
+    }
+
+    __attribute__((target("avx2")))
+    void warp_texels_avx2(const ImageView<double>& img, const Affine2f& a,
+                          const float* xs, const float* ys, int n, double* out) {
+      const __m256d one = _mm256_set1_pd(1.0), zero = _mm256_setzero_pd();
+      alignas(32) double planes[3][4];
+
+      int k = 0;
+      for(;k+8<=n;k+=8) {
+        const Lanes l = transform_lanes(a, xs + k, ys + k, img.rows, img.cols, img.step);
+
+        // the gathers take 4 doubles at a time, do the 8 lanes in two halves
+        for(int h=0;h<2;++h, out+=12) {
+          const __m128i offset = h == 0 ? _mm256_castsi256_si128(l.offset) : _mm256_extracti128_si256(l.offset, 1);
+          const __m128i v = h == 0 ? _mm256_castsi256_si128(l.valid) : _mm256_extracti128_si256(l.valid, 1);
+          const __m256d valid = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(v));
+          const __m256d dx = _mm256_cvtps_pd(h == 0 ? _mm256_castps256_ps128(l.dx) : _mm256_extractf128_ps(l.dx, 1));
+          const __m256d dy = _mm256_cvtps_pd(h == 0 ? _mm256_castps256_ps128(l.dy) : _mm256_extractf128_ps(l.dy, 1));
+
+          const __m256d w00 = _mm256_mul_pd(_mm256_sub_pd(one, dx), _mm256_sub_pd(one, dy));
+          const __m256d w01 = _mm256_mul_pd(dx, _mm256_sub_pd(one, dy));
+          const __m256d w10 = _mm256_mul_pd(_mm256_sub_pd(one, dx), dy);
+          const __m256d w11 = _mm256_mul_pd(dx, dy);
+
+          for(int c=0;c<3;++c) {
+            const double* p0 = img.data + c;
+            const double* p1 = p0 + img.step;
+            const __m256d g00 = _mm256_mask_i32gather_pd(zero, p0, offset, valid, 8);
+            const __m256d g01 = _mm256_mask_i32gather_pd(zero, p0 + 3, offset, valid, 8);
+            const __m256d g10 = _mm256_mask_i32gather_pd(zero, p1, offset, valid, 8);
+            const __m256d g11 = _mm256_mask_i32gather_pd(zero, p1 + 3, offset, valid, 8);
+            __m256d s = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(g00, w00),
+                                                                  _mm256_mul_pd(g01, w01)),
+                                                    _mm256_mul_pd(g10, w10)),
+                                      _mm256_mul_pd(g11, w11));
+            s = _mm256_and_pd(valid, s);
+            _mm256_store_pd(planes[c], s);
+          }
+
+          for(int t=0;t<4;++t) {
+            out[t*3] = planes[0][t];
+            out[t*3+1] = planes[1][t];
+            out[t*3+2] = planes[2][t];
+          }
+        }
+      }
+
+      warp_texels_scalar(img, a, xs + k, ys + k, n - k, out);
+    }
+
+    // Fixed point counterpart of the kernels above for 8-bit images, same
+    // arithmetic as warp_texels_8u_scalar. Each gather fetches the 4 bytes at
+    // a pixel, so one gather per corner covers all three channels; the right
+    // corners are fetched from 2 bytes before them so no read goes past the
+    // last pixel of the image.
+    template <typename T>
+    __attribute__((target("avx2")))
+    void warp_texels_8u_avx2(const ImageView<uchar>& img, const Affine2f& a,
+                             const float* xs, const float* ys, int n, T* out) {
+      const T scale = T(1.0 / (255.0 * frac_one * frac_one));
+      const __m256i zero = _mm256_setzero_si256(), byte_mask = _mm256_set1_epi32(0xFF);
+      const __m256 one = _mm256_set1_ps(frac_one), half = _mm256_set1_ps(0.5f);
+      const int* row0 = reinterpret_cast<const int*>(img.data);
+      const int* row0_right = reinterpret_cast<const int*>(img.data + 2);
+      const int* row1 = reinterpret_cast<const int*>(img.data + img.step);
+      const int* row1_right = reinterpret_cast<const int*>(img.data + img.step + 2);
+      alignas(32) int planes[3][8];
+
+      int k = 0;
+      for(;k+8<=n;k+=8, out+=24) {
+        const Lanes l = transform_lanes(a, xs + k, ys + k, img.rows, img.cols, img.step);
+
+        const __m256i wx = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(l.dx, one), half));
+        const __m256i wy = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(l.dy, one), half));
+        // (1 - wx, wx) as 16-bit pairs, so madd does the horizontal pass
+        const __m256i wpair = _mm256_or_si256(_mm256_sub_epi32(_mm256_set1_epi32(frac_one), wx),
+                                              _mm256_slli_epi32(wx, 16));
+
+        const __m256i g00 = _mm256_mask_i32gather_epi32(zero, row0, l.offset, l.valid, 1);
+        const __m256i g01 = _mm256_srli_epi32(_mm256_mask_i32gather_epi32(zero, row0_right, l.offset, l.valid, 1), 8);
+        const __m256i g10 = _mm256_mask_i32gather_epi32(zero, row1, l.offset, l.valid, 1);
+        const __m256i g11 = _mm256_srli_epi32(_mm256_mask_i32gather_epi32(zero, row1_right, l.offset, l.valid, 1), 8);
+
+        for(int c=0;c<3;++c) {
+          const __m128i shift = _mm_cvtsi32_si128(c * 8);
+          const __m256i top = _mm256_madd_epi16(
+            _mm256_or_si256(_mm256_and_si256(_mm256_srl_epi32(g00, shift), byte_mask),
+                            _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(g01, shift), byte_mask), 16)),
+            wpair);
+          const __m256i bottom = _mm256_madd_epi16(
+            _mm256_or_si256(_mm256_and_si256(_mm256_srl_epi32(g10, shift), byte_mask),
+                            _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(g11, shift), byte_mask), 16)),
+            wpair);
+          const __m256i v = _mm256_add_epi32(_mm256_slli_epi32(top, frac_bits),
+                                             _mm256_mullo_epi32(_mm256_sub_epi32(bottom, top), wy));
+          _mm256_store_si256(reinterpret_cast<__m256i*>(planes[c]), _mm256_and_si256(v, l.valid));
+        }
+
+        for(int t=0;t<8;++t) {
+          out[t*3] = T(planes[0][t]) * scale;
+          out[t*3+1] = T(planes[1][t]) * scale;
+          out[t*3+2] = T(planes[2][t]) * scale;
+        }
+      }
+
+      warp_texels_8u_scalar(img, a, xs + k, ys + k, n - k, out);
+    }
+#endif
+
+  }
+
+  template <typename T>
+  void WarpTexels(const cv::Mat& img, const Affine2f& tform,
+                  const float* xs, const float* ys, int n, T* out) {
+    if(img.depth() == CV_8U) {
+      const ImageView<uchar> view = make_view<uchar>(img);
+#ifdef AAM_WARP_AVX2
+      if(use_avx2) {
+        warp_texels_8u_avx2(view, tform, xs, ys, n, out);
+        return;
+      }
+#endif
+      warp_texels_8u_scalar(view, tform, xs, ys, n, out);
+      return;
+    }
+
+    const ImageView<T> view = make_view<T>(img);
+#ifdef AAM_WARP_AVX2
+    if(use_avx2) {
+      warp_texels_avx2(view, tform, xs, ys, n, out);
+      return;
+    }
+#endif
+    warp_texels_scalar(view, tform, xs, ys, n, out);
+  }
+
+  bool SetWarpKernel(WarpKernel kernel) {
+#ifdef AAM_WARP_AVX2
+    if(kernel == WarpKernel::AVX2 && !cpu_has_avx2()) return false;
+    use_avx2 = kernel == WarpKernel::AVX2 || (kernel == WarpKernel::Auto && cpu_has_avx2());
+    return true;
+#else
+    return kernel != WarpKernel::AVX2;
+#endif
+  }
+
+  template void WarpTexels<float>(const cv::Mat&, const Affine2f&, const float*, const float*, int, float*);
+  template void WarpTexels<double>(const cv::Mat&, const Affine2f&, const float*, const float*, int, double*);
+
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "common.h"
+#include "texelindex.h"
+
+namespace aam {
+
+  // 2x3 affine transform in single precision
+  //   x' = m00 * x + m01 * y + m02
+  //   y' = m10 * x + m11 * y + m12
+  struct Affine2f {
+    float m00, m01, m02, m10, m11, m12;
+
+    Affine2f() : m00(1), m01(0), m02(0), m10(0), m11(1), m12(0) {}
+    // from a 2x3 CV_64FC1 matrix, e.g. the output of cv::getAffineTransform
+    explicit Affine2f(const cv::Mat& m)
+      : m00(m.at<double>(0, 0)), m01(m.at<double>(0, 1)), m02(m.at<double>(0, 2)),
+        m10(m.at<double>(1, 0)), m11(m.at<double>(1, 1)), m12(m.at<double>(1, 2)) {}
+  };
+
+  // Bilinearly samples the 3-channel image img (CV_32FC3 for T = float,
+  // CV_64FC3 for T = double) at the positions tform maps (xs[k], ys[k]) to
+  // and writes the n samples in order to out, 3 values each. Positions are
+  // truncated like SampleImage does, samples whose 2x2 neighbourhood leaves
+  // the image are zero.
+  //
+  // img may also be CV_8UC3, it is then interpolated in 16-bit fixed point
+  // with 8-bit weights and the samples are scaled to [0, 1] on output.
+  //
+  // An AVX2 kernel handling 8 texels per step with gathers is used when the
+  // CPU supports it, a scalar one otherwise. Both give identical results as
+  // long as warp.cpp is built without floating point contraction, which the
+  // build enforces with -ffp-contract=off.
+  template <typename T>
+  void WarpTexels(const cv::Mat& img, const Affine2f& tform,
+                  const float* xs, const float* ys, int n, T* out);
+
+  // Kernels WarpTexels can run on
+  enum class WarpKernel {
+    Auto,    //!< AVX2 if the CPU supports it, scalar otherwise
+    Scalar,
+    AVX2
+  };
+
+  // Selects the kernel of every later WarpTexels call in the process, e.g.
+  // to compare them. Returns false, and keeps the current one, if this
+  // build or CPU has no such kernel.
+  bool SetWarpKernel(WarpKernel kernel);
+
+  // Warps img with one affine transform per triangle straight into a
+  // texture vector: texel k of index is sampled at tforms[j] applied to its
+  // coordinates, j being its triangle, and written to tex[k]. No full frame
+  // image is produced, so tex can be a row of the texture matrix.
+  template <typename T = double>
+  void WarpImageToTexture(const cv::Mat& img,
+                          const std::vector<cv::Mat>& tforms,
+                          const TexelIndex& index,
+                          cv::Vec<T, 3>* tex) {
+    const int ntriangles = tforms.size();
+    for(int j=0;j<ntriangles;++j) {
+      const int begin = index.offsets[j], n = index.count(j);
+      if(n == 0) continue;
+      WarpTexels<T>(img, Affine2f(tforms[j]), &index.xs[begin], &index.ys[begin], n, tex[begin].val);
+    }
+  }
+
+  // Warps img into a texture vector through the barycentric coordinates of
+  // index, which must be filled by ComputeBarycentrics. shape holds the
+  // landmarks of img as (x0, y0, x1, y1, ...); the texels of triangle j are
+  // sampled at w0 * v0 + w1 * v1 + (1 - w0 - w1) * v2 with v its vertices in
+  // shape, an affine map of (w0, w1) that only needs the three vertices.
+  template <typename T = double>
+  void WarpImageToTexture(const cv::Mat& img,
+                          const cv::Mat& shape,
+                          const std::vector<cv::Vec3i>& triangles,
+                          const TexelIndex& index,
+                          cv::Vec<T, 3>* tex) {
+    assert(index.w0.size() == index.rows.size());
+    const double* v = shape.ptr<double>(0);
+    const int ntriangles = triangles.size();
+    for(int j=0;j<ntriangles;++j) {
+      const int begin = index.offsets[j], n = index.count(j);
+      if(n == 0) continue;
+
+      const double* v0 = v + triangles[j][0] * 2;
+      const double* v1 = v + triangles[j][1] * 2;
+      const double* v2 = v + triangles[j][2] * 2;
+      Affine2f tform;
+      tform.m00 = v0[0] - v2[0]; tform.m01 = v1[0] - v2[0]; tform.m02 = v2[0];
+      tform.m10 = v0[1] - v2[1]; tform.m11 = v1[1] - v2[1]; tform.m12 = v2[1];
+      WarpTexels<T>(img, tform, &index.w0[begin], &index.w1[begin], n, tex[begin].val);
+    }
+  }
+
+  // Same as WarpImageToTexture, but stores every sample at its texel's
+  // coordinates in an image of the size of img
+  template <typename T = double>
+  cv::Mat WarpImage(const cv::Mat& img,
+                    const std::vector<cv::Mat>& tforms,
+                    const TexelIndex& index) {
+    typedef cv::Vec<T, 3> Pixel;
+    cv::Mat warped(img.rows, img.cols, CV_MAKETYPE(cv::DataType<T>::depth, 3), cv::Scalar(0, 0, 0));
+
+    std::vector<Pixel> samples(index.size());
+    if(samples.empty()) return warped;
+    WarpImageToTexture<T>(img, tforms, index, samples.data());
+    for(int k=0;k<index.size();++k) {
+      warped.at<Pixel>(index.rows[k], index.cols[k]) = samples[k];
+    }
+
+    return warped;
+  }
+
+}